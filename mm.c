@@ -5,17 +5,107 @@
  * 较小的块(SIZE <= 2*DSIZE)使用一个双向链表连接。
  * 由于WRITEUP中明确堆最大长度为4字节,因此HEADER,FOOTER,PRED,SUCC四个指针都可以4字节表示，只需加上堆初始偏移量即可
  * 所以该分配器准许的最小块大小为2*DSIZ，最小块由一个单独的双向链表连接
+ * 这些4字节的偏移量可以再右移MM_PTR_SHIFT位保存(块地址总是8字节对齐，最多右移3位)，堆的上限随之变为4GB << MM_PTR_SHIFT。
+ * 块大小仍按8字节对齐，MM_PTR_SHIFT不为0时HEADER和FOOTER加宽为8字节(HSIZE)，以容纳超过4GB的块大小。
  * 对于较大的块(SIZE >= 2*DSIZE + WSIZE,大小向WSIZE对齐)，为了实现快速的best_fit查找，使用
  * Binary Search Tree来记录各个节点，对于大小相同的块，只需要悬挂在某一块之下即可(Hanger)
  * 这样这棵二叉树首先是BST,其次每个节点实际上是一个分离的空闲链表，里面存储着对应节点块大小的所有空闲块。
+ * 为了避免按大小顺序释放时BST退化成链表，这棵BST实现为红黑树，节点颜色保存在空闲块HEADER的第三位(STAT_RED)，
+ * 因此不需要额外的存储空间，find_fit/insert_node/delete在最坏情况下都是O(log n)，n为不同空闲块大小的个数。
+ * BST的根和小块链表保存在arena中。定义MM_THREADS时每个线程绑定到一个arena(最多MM_MAX_ARENAS个)，
+ * arena各自从共享的堆顶切出chunk，chunk之间用结尾块隔开，合并不会越过arena的边界；
+ * 其它线程释放的块通过无锁栈交还给所属的arena，由该arena下一次malloc/free时统一释放。
+ * 不超过SLAB_MAX_SIZE的请求由slab分配：每个slab是一个页对齐的页，存放同一大小类的对象，对象没有HEADER，
+ * 空闲对象记录在slab头部的位图中，用find-first-set查找；slab页从堆中一次申请SLAB_RUN个，
+ * 页表slab_page_map记录哪些页是slab，free时由地址直接找到slab。
+ * slab之前还有一层线程私有的tcache：释放的小对象按大小类放入对应的bin，不回到slab，
+ * 下一次同样大小类的malloc不加锁直接取出。每个bin最多TCACHE_DEPTH个对象，调用mm_tcache_flush()时全部还给slab。
+ * 定义MM_TLSF时空闲块不再使用BST，而是使用两级分离适配(TLSF)：按大小的最高位和其后TLSF_SL_SHIFT位
+ * 分到free_lists[fl][sl]中，两级位图用find-first-set查找，malloc/free最坏情况都是O(1)。
+ * 两种引擎使用相同的HEADER/FOOTER格式，TLSF的PRED/SUCC与小块链表一样存放在LCHILD/RCHILD的位置。
+ * 定义MM_BTREE时索引完全放在块之外：每个空闲块是一个64位的键(块大小 << 32 | 压缩的偏移)，
+ * 键有序地存放在mmap申请的叶子中，叶子的下界另外存成一个有序数组。find_fit只在这个数组和一两个叶子中
+ * 二分查找，得到的是地址最低的最佳适配块，插入和删除也只读写被选中的块本身，不会碰到其它空闲块的页。
+ * 不小于mmap_threshold的请求不进入堆，直接用mmap映射，这种块的HEADER中大小为0(堆中的块不会如此)，
+ * HEADER之前保存映射的长度和一个魔数，free时立即munmap，realloc时用mremap，不需要复制。
+ * 合并后不小于trim_threshold的空闲块，其内部整页(不含HEADER、FOOTER和链接字)用madvise归还给内核，
+ * mm_trim(pad)对所有空闲块做同样的事，堆顶的空闲块保留pad字节。
+ * 找不到合适的块时，堆按几何增长的大小拓展：两次拓展之间的分配次数少于MM_GROW_WINDOW时加倍，
+ * 长时间没有拓展则减半，限制在[grow_min, grow_max]之间，连续的分配只需要O(log n)次拓展。
+ * memalign等对齐分配从空闲块中切出对齐的块，对齐地址之前的部分作为空闲块放回，不浪费空间。
+ * calloc不总是memset：mmap的块本来就是全零的页；堆拓展得到的页由内核清零时(MM_RESERVE)，新的空闲块在
+ * FOOTER中记STAT_ZERO，表示payload中除链接字和FOOTER外全为零，分割和从堆顶拓展时保留这一位，其它写FOOTER的地方
+ * 都把它清掉。从这样的块中分配时只需清掉残留的链接字和FOOTER。
+ * mm_stats()返回各种计数器：malloc/free/realloc的次数、使用中的字节数和大小直方图记在每个线程自己的
+ * counters中，不需要原子操作；空闲块的个数和字节数、BST节点和悬挂节点的个数记在arena中，在锁内维护。
+ * 以MM_LATENCY编译时，malloc/free/realloc/find_fit/extend_heap的每次调用都会计时(x86上用rdtsc)，
+ * 记入按2的幂分桶的直方图，同时统计树上走过的步数、合并的各种情况等慢路径事件，
+ * 可以用mm_latency_bucket/mm_slowpath_count读取，或用mm_latency_signal注册信号后随时输出。
+ * 不定义MM_LATENCY时这些宏都是空的，没有任何开销。
+ * 以MM_PROFILE编译时对堆做抽样剖析：每个线程平均每分配prof_rate字节(间隔服从指数分布)抽中一次分配，
+ * 记录调用栈和大小。相同调用栈的样本累计在一个桶中，样本本身按地址放在另一张表里，free时删除；
+ * free先查一个按地址哈希的计数过滤器，没有抽中的块不需要加锁查表。这些表都直接用mmap申请，
+ * 不经过分配器本身。mm_heap_profile_dump可以输出pprof的heap格式(同时包含使用中和累计的分配)，
+ * 或者折叠栈格式，交给flamegraph。
+ * mm_arena_create等函数提供按请求整体释放的区域(与内部的arena_t无关)：区域从堆中整块申请chunk，
+ * 区域内的分配只是移动指针，reset/destroy时逐个chunk交还，不需要逐个free。区域本身不加锁，
+ * 同一时间只能由一个线程使用，其中的内存不能传给free。
+ * mm_pool_create等函数提供固定大小对象的池：池用memalign从堆中申请按自身大小对齐的slab，对象在slab中
+ * 连续排列，没有HEADER，空闲对象经由对象本身串成链表；free时由地址对齐找到slab，slab全空时交还给堆。
+ * 池同样不加锁。
+ * mm_malloc_batch一次找一个足够大的空闲块，再从中连续切出所有的块；mm_free_batch先按地址排序，
+ * 相邻的块连成一段，每段只合并和插入一次。
+ * mm_malloc_hint(size, MM_HINT_SHORT)把短命的块放到单独的arena(ARENA_SHORT)中，它有自己的空闲结构，
+ * 不会夹在长期存活的块之间，释放后更容易合并。ARENA_SHORT没有自己的chunk，需要空间时从当前线程的arena
+ * 分配一个页对齐的载体块，在其中切出一段小chunk，页表short_page_map记录这些页，free时由地址找到ARENA_SHORT；
+ * 小chunk的大小按ARENA_SHORT已有的大小加倍(在SHORT_CHUNK_MIN与SHORT_CHUNK_MAX之间)，那个arena中没有这么大的
+ * 空闲块时只切出这次需要的大小，不为它拓展堆；整段空闲时载体还给原来的arena。堆小于SHORT_MIN_HEAP时
+ * 分开放置省下的碎片抵不上这些小chunk的空闲部分，提示不起作用。
+ * mm_halloc分配可以移动的对象，使用者只持有句柄，用mm_hpin取得地址并固定，mm_hunpin之后地址失效。
+ * 句柄块的payload以句柄号开头，句柄表记录每个句柄所在的块。mm_compact按地址顺序遍历当前arena的块，
+ * 把前面是空闲块的、未被固定的句柄块前移，空闲空间逐渐汇集到chunk末尾后归还其中的整页；
+ * 每次调用只做budget字节的工作，游标保存在arena中，下次接着做。
+ * 以MM_PERSIST编译时可以用mm_persist_open把堆放在一个文件的共享映射中(代替mem_sbrk)。堆内部只用相对
+ * virtual_NULL的偏移，全局状态(arena中的root、small_free_block_list、slab链表，chunk_owner等)在
+ * mm_persist_sync时写进文件开头的头部，再次打开时整体拷回，不需要重建任何结构。文件优先映射在保存时的地址，
+ * 地址被占用时映射到别处，头部和slab中的绝对指针按差值修正，用户数据中的指针则只有偏移仍然有效。
+ * mm_persist_sync可以随时作为检查点调用，之后第一次修改堆时清掉头部的clean标记，未同步就崩溃的文件打开时被拒绝。
+ * 持久化只支持单线程和BST、TLSF引擎；堆打开期间不使用mmap，所有块都在文件中；句柄表不保存。
+ * 以MM_RESERVE编译时堆不再向memlib申请，而是在mm_init时一次保留MM_RESERVE_SIZE字节的地址空间(PROT_NONE，
+ * 不占内存也不计入提交量)，mem_sbrk拓展时只把新用到的页mprotect为可读写，所以堆永远不会移动，virtual_NULL不变，
+ * 初始化的代价也与堆的上限无关。mm_trim时若堆顶是空闲块，堆真正缩小，多出的页重新映射为PROT_NONE，交还内存和提交量。
+ * MM_HUGEPAGE在MM_RESERVE的基础上使用透明大页：保留的范围按2MB对齐并madvise(MADV_HUGEPAGE)，提交按大页进行，
+ * 块头分散在很多页上时find_fit、coalesce的TLB缺失随之减少。归还内存(release_pages、mm_compact、mm_trim)
+ * 都以大页为单位，只归还完整的对齐大页，不会把大页拆成小页。
 */
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+#ifdef MM_LATENCY
+#include <signal.h>
+#include <time.h>
+#endif
+#ifdef MM_PROFILE
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#endif
+#ifdef MM_PERSIST
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
 
 #include "mm.h"
+#include "mm_ext.h"
 #include "memlib.h"
 
 #ifdef DRIVER
@@ -23,45 +113,246 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #endif
 /* def DRIVER */
 #define WSIZE 4
 #define DSIZE 8
 
 
-#define ALIGNMENT 8
-#define MIN_BST_NODE_SIZE (2 * DSIZE + WSIZE)
-#define MIN_BLOCK_SIZE (2 * DSIZE)
-#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
+/* 压缩指针右移的位数，0到3，堆的上限为MAX_HEAP_SIZE */
+#ifndef MM_PTR_SHIFT
+#define MM_PTR_SHIFT 0
+#endif
+#define MAX_HEAP_SIZE (1UL << (32 + MM_PTR_SHIFT))
+
+/* HEADER和FOOTER的字长，堆超过4GB时一个块也可能超过4GB，大小字段放不进4字节，HEADER加宽为8字节 */
+#if MM_PTR_SHIFT > 0
+#define HSIZE 8
+typedef unsigned long hdr_t;
+#else
+#define HSIZE WSIZE
+typedef unsigned int hdr_t;
+#endif
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+
+/* 块大小与payload的对齐单位 */
+#define ALIGNMENT DSIZE
+#define MIN_BST_NODE_SIZE (2 * HSIZE + 4 * WSIZE)
+#define MIN_BLOCK_SIZE (2 * HSIZE + 2 * WSIZE)//HEADER, PRED, SUCC and FOOTER
+#define PROLOGUE_SIZE (2 * HSIZE)
+#define HEAP_PAD (4 * WSIZE)//keeps every payload ALIGNMENT-aligned
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
+
+/* 多线程模式下arena的个数，以及arena向共享堆申请chunk的对齐单位 */
+#ifndef MM_MAX_ARENAS
+#ifdef MM_THREADS
+#define MM_MAX_ARENAS 16
+#else
+#define MM_MAX_ARENAS 1
+#endif
+#endif
+/* 短命块专用的arena排在线程的arena之后 */
+#define ARENA_SHORT MM_MAX_ARENAS
+#define NARENAS (MM_MAX_ARENAS + 1)
+#define ARENA_UNIT_SHIFT 20
+#define ARENA_UNIT (1UL << ARENA_UNIT_SHIFT)
+#define SHORT_CHUNK_MIN (16 * 1024UL)//first chunk ARENA_SHORT carves out of another arena
+#define SHORT_CHUNK_MAX (256 * 1024UL)//upper bound of the geometric chunks of ARENA_SHORT
+#define SHORT_MIN_HEAP (16 * SHORT_CHUNK_MAX)//heap size below which MM_HINT_SHORT is ignored
+
+/* slab的大小、头部大小、每次从堆中申请的slab个数以及大小类 */
+#define SLAB_SHIFT 12
+#define SLAB_SIZE (1UL << SLAB_SHIFT)
+#define SLAB_HDR_SIZE ((sizeof(slab_t) + 15) & ~15UL)
+#define SLAB_RUN 16
+#define SLAB_CLASSES 14
+#define SLAB_MAX_SIZE 512
+#define SLAB_EMPTY SLAB_CLASSES
+#define SLAB_OF(p) ((slab_t *) ((unsigned long)(p) & ~(SLAB_SIZE - 1)))
+#define SLAB_PAGE(p) (((unsigned long)(p) - virtual_NULL) >> SLAB_SHIFT)
+#define IN_HEAP(p) ((unsigned long)(p) - virtual_NULL < MAX_HEAP_SIZE)
+#define IS_SLAB(p) (IN_HEAP(p) && __atomic_load_n(&slab_page_map[SLAB_PAGE(p) >> 3], __ATOMIC_RELAXED) & (1 << (SLAB_PAGE(p) & 7)))
+#define IS_SHORT(p) (IN_HEAP(p) && __atomic_load_n(&short_page_map[SLAB_PAGE(p) >> 3], __ATOMIC_RELAXED) & (1 << (SLAB_PAGE(p) & 7)))
+
+/* 空闲块引擎：默认为BST，MM_TLSF为两级分离适配，MM_BTREE为块外的有序索引 */
+#if !defined(MM_TLSF) && !defined(MM_BTREE)
+#define MM_BST
+#endif
+
+/* B树索引每个叶子的键数(叶子正好256字节)，以及每次mmap的叶子个数 */
+#define BT_LEAF_KEYS 31
+#define BT_LEAF_BATCH 256
+#define BT_KEY(size, bp) ((unsigned long) ((size) / ALIGNMENT) << 32 | TRUNCATE(bp))
+#define BT_KEY_SIZE(key) (((key) >> 32) * ALIGNMENT)
+#define BT_KEY_BLKP(key) EXPAND((key) & 0xffffffffUL)
+
+/* TLSF的两级索引：小于TLSF_SMALL的块按DSIZE线性划分到第0级，
+ * 其余块按最高位分到第一级，每一级再均分为TLSF_SL_COUNT份 */
+#define TLSF_SL_SHIFT 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_SHIFT)
+#define TLSF_SMALL (TLSF_SL_COUNT * DSIZE)
+#define TLSF_FL_OFFSET 6
+#define TLSF_FL_COUNT (32 + MM_PTR_SHIFT - TLSF_FL_OFFSET)
+
+/* 默认的mmap阈值，以及mmap块HEADER之前保存映射长度的空间 */
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (1UL << 20)
+#endif
+#define MMAP_HDR_SIZE (4 * DSIZE)//length, magic and HEADER
+#define MMAP_LEN(bp) (*(size_t *) ((char *) (bp) - MMAP_HDR_SIZE))
+#define MMAP_MAGIC(bp) (*(size_t *) ((char *) (bp) - MMAP_HDR_SIZE + DSIZE))
+#define MMAP_MAGIC_WORD 0x4d4d41505045440aUL
+
+/* 合并后的空闲块不小于该大小时归还其中的整页 */
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (128UL << 10)
+#endif
+#define FREE_LINK_SIZE (4 * WSIZE)//LCHILD, RCHILD, PARENT and HANGER
+
+/* 堆拓展大小的上下限，以及判断缺失频繁的分配次数窗口 */
+#ifndef MM_GROW_MIN
+#define MM_GROW_MIN (64UL << 10)
+#endif
+#ifndef MM_GROW_MAX
+#define MM_GROW_MAX (4UL << 20)
+#endif
+#define MM_GROW_WINDOW 64
+
+/* tcache每个bin的最大长度，TCACHE_DEPTH为0时关闭tcache */
+#ifndef TCACHE_DEPTH
+#define TCACHE_DEPTH 7
+#endif
+
+/* 计时的操作和慢路径事件，SLOW_COALESCE + i为合并的第i种情况 */
+#define LAT_MALLOC 0
+#define LAT_FREE 1
+#define LAT_REALLOC 2
+#define LAT_FIND_FIT 3
+#define LAT_EXTEND_HEAP 4
+#define LAT_OPS 5
+#define SLOW_TREE_WALKS 0
+#define SLOW_TREE_STEPS 1
+#define SLOW_COALESCE 2
+#define SLOW_EXTEND 6
+#define SLOW_REMOTE_FREE 7
+#define SLOW_EVENTS 8
+
+#ifdef MM_LATENCY
+#if defined(__x86_64__) || defined(__i386__)
+#define LAT_NOW() ((unsigned long) __builtin_ia32_rdtsc())
+#define LAT_UNIT "cycles"
+#else
+#define LAT_NOW() lat_clock_ns()
+#define LAT_UNIT "ns"
+#endif
+#define LAT_TIME(op, stmt) do { unsigned long lat_start_ = LAT_NOW(); stmt; lat_record(op, LAT_NOW() - lat_start_); } while (0)
+#define SLOW_COUNT(ev, n) __atomic_fetch_add(&slow_counts[ev], (n), __ATOMIC_RELAXED)
+#else
+#define LAT_TIME(op, stmt) stmt
+#define SLOW_COUNT(ev, n) ((void) (n))
+#endif
+
+/* 抽样的平均间隔(字节)、记录的栈深度，以及free时过滤器的大小 */
+#ifndef MM_PROF_RATE
+#define MM_PROF_RATE (512UL << 10)
+#endif
+#define MM_PROF_DEPTH 32
+#define PROF_FILTER_SHIFT 16
+#define PROF_FILTER_SLOT(p) (((unsigned long)(p) >> 4) * 0x9e3779b97f4a7c15UL >> (64 - PROF_FILTER_SHIFT))
+
+/* 区域每次向堆申请的chunk大小，超过chunk四分之一的请求单独申请一个chunk */
+#ifndef MM_REGION_CHUNK
+#define MM_REGION_CHUNK (64UL << 10)
+#endif
+
+/* 对象池slab的最小大小，slab大小是2的幂并且按自身大小对齐 */
+#ifndef MM_POOL_SLAB
+#define MM_POOL_SLAB (64UL << 10)
+#endif
+#define POOL_MIN_OBJECTS 8
+
+/* 句柄表最多的句柄数，表按此大小保留地址空间，用到的部分才占用内存 */
+#ifndef MM_MAX_HANDLES
+#define MM_MAX_HANDLES (1UL << 22)
+#endif
+/* 压缩时检查一个块的代价，约为读一条缓存行，与移动的字节数一起计入budget */
+#define COMPACT_VISIT_COST 64
+
+#ifdef MM_PERSIST
+#if defined(MM_THREADS) || defined(MM_BTREE)
+#error "MM_PERSIST supports only the single-threaded BST and TLSF engines"
+#endif
+#define PERSIST_MAGIC "MMHEAP01"
+#endif
+
+/* 透明大页的大小，MM_HUGEPAGE需要由MM_RESERVE保留对齐的地址空间 */
+#ifdef MM_HUGEPAGE
+#ifndef MM_RESERVE
+#define MM_RESERVE
+#endif
+#define HUGE_PAGE_SIZE (2UL << 20)
+#endif
+
+/* MM_RESERVE保留的地址空间，即堆的上限 */
+#ifdef MM_RESERVE
+#ifdef MM_PERSIST
+#error "MM_RESERVE and MM_PERSIST are two different heap backends"
+#endif
+#ifndef MM_RESERVE_SIZE
+#define MM_RESERVE_SIZE MAX_HEAP_SIZE
+#endif
+#if MM_RESERVE_SIZE > MAX_HEAP_SIZE
+#error "MM_RESERVE_SIZE exceeds MAX_HEAP_SIZE"
+#endif
+#endif
+
+#ifdef MM_PROFILE
+#define PROF_ALLOC(bp, size) do { if ((bp) != NULL && (prof_left -= (long) (size)) < 0) prof_sample(bp, size); } while (0)
+#define PROF_FREE(bp) do { if (__atomic_load_n(&prof_filter[PROF_FILTER_SLOT(bp)], __ATOMIC_RELAXED) != 0) prof_forget(bp); } while (0)
+#else
+#define PROF_ALLOC(bp, size)
+#define PROF_FREE(bp)
+#endif
 
 /* Pack a size and allocated bit into a word */
-#define PACK(size, alloc)  ((size) | (alloc))
+#define PACK(size, alloc)  ((hdr_t)(size) | (alloc))
 
-/* Read and write a word at address p */
-#define GET(p)       (*(unsigned int *)(p))
-#define PUT(p, val)  (*(unsigned int *)(p) = (val))
+/* Read and write a header word at address p */
+#define GET(p)       (*(hdr_t *)(p))
+#define PUT(p, val)  (*(hdr_t *)(p) = (val))
+
+/* Read and write a 4-byte link word at address p */
+#define GET_LINK(p)       (*(unsigned int *)(p))
+#define PUT_LINK(p, val)  (*(unsigned int *)(p) = (val))
 
 /* Statement bit,在HEADER中保存，分别记录当前块以及前一块是否被分配
  * 优化：只有在当前块FREE状态时才会用到footer，所以可以多一个WORD的存储
  */
 #define STAT_ALLOC 0x1
 #define STAT_PREV_ALLOC 0x2
+/* 红黑树节点的颜色，只对BST中的空闲块有意义 */
+#define STAT_RED 0x4
+/* 空闲块FOOTER的第三位表示payload中除链接字和FOOTER外全为零，HEADER的这一位已被STAT_RED占用 */
+#define STAT_ZERO 0x4
 
 /* size of a block*/
-#define GET_SIZE(bp) ((GET(HDRP(bp))) & ~0x7)
+#define GET_SIZE(bp) ((size_t)((GET(HDRP(bp))) & ~0x7))
 #define GET_ALLOC(bp) ((GET(HDRP(bp))) & 0x1)
-#define SIZE(p) (GET(p) & (~0x7))
+#define SIZE(p) ((size_t)(GET(p) & (~0x7)))
 #define ALLOC(p) (GET(p) & (0x1))
 
 /* address of header and footer */
-#define HDRP(bp)       ((char *)(bp) - WSIZE)
-#define FTRP(bp)       ((char *)(bp) + SIZE(HDRP(bp)) - DSIZE)
+#define HDRP(bp)       ((char *)(bp) - HSIZE)
+#define FTRP(bp)       ((char *)(bp) + SIZE(HDRP(bp)) - 2 * HSIZE)
 
 /* address of previous and next block */
-#define NEXT_BLKP(bp)  ((char *)(bp) + SIZE(((char *)(bp) - WSIZE)))
-#define PREV_BLKP(bp)  ((char *)(bp) - SIZE(((char *)(bp) - DSIZE)))
+#define NEXT_BLKP(bp)  ((char *)(bp) + SIZE(((char *)(bp) - HSIZE)))
+#define PREV_BLKP(bp)  ((char *)(bp) - SIZE(((char *)(bp) - 2 * HSIZE)))
 
 /* address of both children, parent, hanger*/
 #define LCHILD(bp) ((char *)(bp))
@@ -75,11 +366,23 @@
 #define SET_PREV_ALLOC(bp) (GET(HDRP(bp)) |= 0x2)
 #define CLEAR_PREV_ALLOC(bp) (GET(HDRP(bp)) &= ~0x2)
 
+/* 空闲块的payload是否已知为零 */
+#define IS_ZERO_BLOCK(bp) (GET(FTRP(bp)) & STAT_ZERO)
+
+/* 是否是mmap映射的块：堆中块的HEADER里大小不为0，只比较HEADER就能排除，不能用于slab对象 */
+#define IS_MMAPPED(bp) (GET(HDRP(bp)) == STAT_ALLOC && MMAP_MAGIC(bp) == MMAP_MAGIC_WORD)
+
 /* get the pointers which point to children, parent and hanger*/
-#define LCHILD_BLKP(bp) ((unsigned long)GET(LCHILD(bp)) + (virtual_NULL))
-#define RCHILD_BLKP(bp) ((unsigned long)GET(RCHILD(bp)) + (virtual_NULL))
-#define PARENT_BLKP(bp) ((unsigned long)GET(PARENT(bp)) + (virtual_NULL))
-#define HANGER_BLKP(bp) ((unsigned long)GET(HANGER(bp)) + (virtual_NULL))
+#define EXPAND(off) (((unsigned long)(off) << MM_PTR_SHIFT) + (virtual_NULL)) //convert 4_byte_offset to addr
+#define LCHILD_BLKP(bp) EXPAND(GET_LINK(LCHILD(bp)))
+#define RCHILD_BLKP(bp) EXPAND(GET_LINK(RCHILD(bp)))
+#define PARENT_BLKP(bp) EXPAND(GET_LINK(PARENT(bp)))
+#define HANGER_BLKP(bp) EXPAND(GET_LINK(HANGER(bp)))
+
+/* color of BST node, virtual_NULL is always black */
+#define IS_RED(bp) ((void *) (bp) != (void *) virtual_NULL && (GET(HDRP(bp)) & STAT_RED))
+#define SET_RED(bp) (GET(HDRP(bp)) |= STAT_RED)
+#define SET_BLACK(bp) (GET(HDRP(bp)) &= ~STAT_RED)
 
 /* pred and succ for small block free list */
 #define S_PRED_BLKP(bp) LCHILD_BLKP(bp)
@@ -89,11 +392,11 @@
 /* change the value */
 #define PUT_HDRP(bp, val) (PUT(HDRP(bp), val))
 #define PUT_FTRP(bp, val) (PUT(FTRP(bp), val))
-#define TRUNCATE(val) ((unsigned int)(unsigned long)(val)) //convert 4_byte_addr to addr
-#define PUT_LCHILD(bp, val) (PUT(LCHILD(bp), TRUNCATE(val)))
-#define PUT_RCHILD(bp, val) (PUT(RCHILD(bp), TRUNCATE(val)))
-#define PUT_PARENT(bp, val) (PUT(PARENT(bp), TRUNCATE(val)))
-#define PUT_HANGER(bp, val) (PUT(HANGER(bp), TRUNCATE(val)))
+#define TRUNCATE(val) ((unsigned int)(((unsigned long)(val) - virtual_NULL) >> MM_PTR_SHIFT)) //convert addr to 4_byte_offset
+#define PUT_LCHILD(bp, val) (PUT_LINK(LCHILD(bp), TRUNCATE(val)))
+#define PUT_RCHILD(bp, val) (PUT_LINK(RCHILD(bp), TRUNCATE(val)))
+#define PUT_PARENT(bp, val) (PUT_LINK(PARENT(bp), TRUNCATE(val)))
+#define PUT_HANGER(bp, val) (PUT_LINK(HANGER(bp), TRUNCATE(val)))
 
 /* S refers to 'small' */
 #define PUT_S_PRED(bp, val) PUT_LCHILD(bp, val)
@@ -102,151 +405,2821 @@
 
 /* Global variables and functions */
 
+
 static void *coalesce (void *bp);
 static void *extend_heap (size_t size);
 static void place (void *ptr, size_t asize);
 static void insert_node (void *bp);
-static int judge_child(void * bp);
-static void delete(void *bp);
 static void delete_node (void *bp);
-static void delete_first_node(void * bp, int direction);
 static void *find_fit (size_t asize);
+#ifdef MM_BST
+static int judge_child(void * bp);
+static void delete(void *bp);
+static void delete_first_node(void * bp);
+static void replace_child(void *bp, void *repl);
+static void rotate_left(void *bp);
+static void rotate_right(void *bp);
+static void insert_fixup(void *bp);
+static void delete_fixup(void *child, void *parent);
+static int trim_tree(void *bp, size_t pad);
+static void BST_checker(void * bp);
+#elif defined(MM_TLSF)
+static void tlsf_checker(void);
+#else
+static void bt_checker(void);
+#endif
 static void printBlock(void *bp);
 static void small_free_block_list_checker();
-static void BST_checker(void * bp);
+static void free_block(void *bp);
+static void arena_init(void *arena);
+static void arena_enter(void);
+static void arena_leave(void);
+static void mark_chunk(void *start, size_t len);
+static void *new_chunk(size_t size);
+static void give_pad(char *top, size_t pad);
+static void *short_chunk_add(char *carrier, size_t len);
+static int short_chunk_release(char *bp);
+static void mark_pages(unsigned char *map, void *start, unsigned long npages, int set);
+#ifdef MM_THREADS
+static void bind_arena(void);
+#endif
+static void *block_alloc(size_t asize, size_t *zero);
+static void *aligned_block_alloc(size_t alignment, size_t asize);
+static void shrink_block(void *bp, size_t asize);
+static size_t usable_size(void *ptr);
+static void *slab_alloc(int cls);
+static void slab_free(void *p);
+static void tcache_flush(void);
+static void *mmap_alloc(size_t size);
+static void *mmap_realloc(void *bp, size_t size);
+static int release_pages(void *bp, char *lo, char *hi);
+static void release_freed(void *bp, char *lo, size_t size);
+static int trim_block(void *bp, size_t pad);
+static int trim_free_blocks(size_t pad);
+static size_t grow_size(size_t size);
+static void footprint_add(long delta);
+static size_t largest_free_block(void);
+void *memalign(size_t alignment, size_t size);
+void *calloc(size_t nmemb, size_t size);
 void mm_checkheap(int verbose);
 
 
+/* slab页的头部，对象紧跟在SLAB_HDR_SIZE之后，位图中为1的位表示空闲对象
+ * 同一次申请的SLAB_RUN个slab中，第一个slab的block和live记录整段所在的堆块以及正在使用的slab个数 */
+typedef struct slab {
+    struct slab *next, *prev;//partial list of its class, or empty list of the arena
+    struct slab *first;//first slab of the run
+    void *block;//heap block holding the run, only valid in the first slab
+    unsigned short cls;//size class, SLAB_EMPTY if not in use
+    unsigned short nfree;//number of free objects
+    unsigned short live;//slabs of the run in use, only valid in the first slab
+    unsigned long bitmap[4];
+} slab_t;
+
+/* B树索引的叶子，键按升序排列 */
+typedef struct bt_leaf {
+    unsigned long n;
+    unsigned long keys[BT_LEAF_KEYS];
+} bt_leaf_t;
+
+/* 一个arena拥有自己的BST、小块链表和slab，单线程时只有arenas[0]和ARENA_SHORT */
+typedef struct arena {
+    void *root;//root of the BST
+    void *small_free_block_list;//header of byside linklists with 16-byte blocks
+    slab_t *partial[SLAB_CLASSES];//slabs with at least one free object
+    slab_t *empty;//unused slabs, ready for any class
+    size_t grow_chunk;//size of the next heap extension
+    unsigned long nalloc;//block allocations, to measure the miss rate
+    unsigned long last_extend;//nalloc at the last extension
+    unsigned long nextend;//number of heap extensions
+    size_t extended;//bytes obtained from mem_sbrk
+    size_t carved;//bytes of the chunks ARENA_SHORT carved out of other arenas
+    size_t free_bytes;//bytes in the free structures
+    unsigned long free_blocks;//blocks in the free structures
+    size_t largest_free;//size of the largest block in the free structures
+    unsigned long bst_nodes;//nodes of the BST
+    unsigned long hanger_nodes;//blocks in the hanger lists
+#ifdef MM_TLSF
+    unsigned int fl_bitmap;//bit fl is set if any list of sl_bitmap[fl] is non-empty
+    unsigned short sl_bitmap[TLSF_FL_COUNT];
+    void *free_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    int largest_stale;//the largest block was deleted, mm_stats looks up largest_free again
+#endif
+#ifdef MM_BTREE
+    unsigned long *bt_bounds;//lower bound of the keys of each leaf, sorted
+    struct bt_leaf **bt_leaves;
+    size_t bt_nleaves, bt_cap;
+    struct bt_leaf *bt_spare;//unused leaves, linked through keys[0]
+#endif
+    char *chunk_end;//end of the chunk this arena extended last
+    char *compact_at;//next block mm_compact looks at, 0 to start a new pass
+    char *compact_trim;//pages of the chunk's free tail above this have been released
+#ifdef MM_THREADS
+    pthread_mutex_t lock;
+    void *remote_free_list;//blocks freed by other threads, linked through their payload
+    int nthreads;//number of threads bound to this arena
+#endif
+} arena_t;
+
 static char *heap_listp = 0;//header of all the blocks in heap
 static unsigned long virtual_NULL = 0;//used to point to mem_heap_lo(), the initial offsets for each ptr
-static void *root = 0;//root of the BST
-static void *small_free_block_list = 0;//header of byside linklists with 16-byte blocks
+static arena_t arenas[NARENAS];
+static unsigned char chunk_owner[MAX_HEAP_SIZE >> ARENA_UNIT_SHIFT];//arena index of each ARENA_UNIT of the heap
+#define OWNER_OF(bp) (IS_SHORT(bp) ? &arenas[ARENA_SHORT] : &arenas[chunk_owner[((unsigned long)(bp) - virtual_NULL) >> ARENA_UNIT_SHIFT]])
+
+/* 句柄表的一项，句柄空闲时next串起空闲的句柄 */
+typedef struct {
+    char *bp;//block holding the object, 0 while the handle is free
+    unsigned int pins;
+    unsigned int next;
+} handle_t;
+
+static handle_t *handles = 0;
+static unsigned int handle_top = 1, handle_free = 0;//next never used handle and head of the free handles
+/* 合并之后bp内部的HEADER不再有效，mm_compact的游标落在其中时退回到bp */
+#define COMPACT_ABSORB(bp) do { if (cur_arena->compact_at > (char *) (bp) && cur_arena->compact_at < NEXT_BLKP(bp)) \
+    cur_arena->compact_at = (char *) (bp); } while (0)
+
+#ifdef MM_THREADS
+static __thread arena_t *cur_arena = 0;//arena bound to the calling thread
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;//protects mem_sbrk and arena binding
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+#define HEAP_LOCK() pthread_mutex_lock(&heap_lock)
+#define HEAP_UNLOCK() pthread_mutex_unlock(&heap_lock)
+#else
+static arena_t *cur_arena = &arenas[0];
+#define HEAP_LOCK()
+#define HEAP_UNLOCK()
+#endif
+
+static unsigned char slab_page_map[MAX_HEAP_SIZE >> (SLAB_SHIFT + 3)];//one bit for each page of the heap
+static unsigned char short_page_map[MAX_HEAP_SIZE >> (SLAB_SHIFT + 3)];//pages of the chunks of ARENA_SHORT
+static unsigned short slab_class_size[SLAB_CLASSES] = {
+    16, 24, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512
+};
+static unsigned short slab_class_nobj[SLAB_CLASSES];
+static size_t mmap_threshold = MM_MMAP_THRESHOLD;//requests not smaller than this are mmapped
+static size_t trim_threshold = MM_TRIM_THRESHOLD;//free blocks not smaller than this give their pages back
+static size_t grow_min = MM_GROW_MIN, grow_max = MM_GROW_MAX;//bounds of a heap extension
+static unsigned char slab_class_of[SLAB_MAX_SIZE / DSIZE + 1];//indexed by (size + 7) / 8
+
+/* 每个bin是经由对象相连的单链表，对象在slab中仍然标记为已分配 */
+typedef struct tcache {
+    void *bins[SLAB_CLASSES];
+    unsigned char counts[SLAB_CLASSES];
+    int total;
+} tcache_t;
+
+#ifdef MM_THREADS
+static __thread tcache_t tcache;
+#else
+static tcache_t tcache;
+#endif
+
+/* 每个线程的调用计数，in_use和hist可以为负(释放了其它线程分配的块)，所有线程相加才有意义 */
+typedef struct counters {
+    unsigned long nmalloc, nfree, nrealloc;
+    long in_use;
+    long hist[64];
+    struct counters *next;//list of live threads, protected by heap_lock
+} counters_t;
+
+#ifdef MM_THREADS
+static __thread counters_t counters;
+static counters_t *counters_list = 0;//counters of threads bound to an arena
+static counters_t retired;//sum of exited threads
+/* 只有本线程写，mm_stats读，用relaxed的store避免数据竞争，x86上仍然是普通的写 */
+#define COUNT(field, n) __atomic_store_n(&counters.field, counters.field + (n), __ATOMIC_RELAXED)
+#else
+static counters_t counters;
+#define COUNT(field, n) (counters.field += (n))
+#endif
+#define SIZE_BUCKET(size) (63 - __builtin_clzl(size))
+
+static size_t footprint = 0, peak_footprint = 0;//heap + mapped bytes
+
+#ifdef MM_PERSIST
+/* 堆文件开头的头部，保存恢复堆所需的全局状态，其中的指针按保存时的堆地址lo记录 */
+typedef struct {
+    char magic[8];
+    unsigned long config;//layout the image depends on
+    int clean;//set by mm_persist_sync, cleared while the heap is open and unsynced
+    size_t max_size;//bytes reserved for the heap
+    size_t brk;//bytes of heap in use
+    unsigned long lo;//heap address when the image was saved
+    unsigned long root;//offset of the user's root object, 0 for none
+    size_t footprint, peak_footprint;
+    counters_t counters;
+    arena_t arenas[NARENAS];
+    unsigned char chunk_owner[sizeof(chunk_owner)];
+    unsigned char slab_page_map[sizeof(slab_page_map)];
+    unsigned char short_page_map[sizeof(short_page_map)];
+} persist_hdr_t;
+
+/* 头部占整数个ARENA_UNIT，映射按ARENA_UNIT对齐，所以堆的起点和slab、chunk的对齐在移动后不变 */
+#define PERSIST_HDR_SIZE ((sizeof(persist_hdr_t) + ARENA_UNIT - 1) & ~(ARENA_UNIT - 1))
+#ifdef MM_TLSF
+#define PERSIST_CONFIG ((unsigned long) sizeof(persist_hdr_t) << 16 | MM_PTR_SHIFT << 8 | HSIZE << 4 | 1)
+#else
+#define PERSIST_CONFIG ((unsigned long) sizeof(persist_hdr_t) << 16 | MM_PTR_SHIFT << 8 | HSIZE << 4)
+#endif
+
+static struct {
+    int fd;
+    persist_hdr_t *hdr;//start of the file mapping, the heap follows the header
+    size_t max_size, brk, file_size;
+    int synced;//the file is marked clean, the next change to the heap must clear the mark first
+} persist = {-1, 0, 0, 0, 0, 0};
+
+static void persist_dirty(void);
+
+/* 打开堆文件后由文件提供堆，否则仍然交给memlib */
+static void *persist_sbrk(int incr);
+static void *persist_heap_lo(void);
+static void *persist_heap_hi(void);
+static size_t persist_heapsize(void);
+#define mem_sbrk(incr) persist_sbrk(incr)
+#define mem_heap_lo() persist_heap_lo()
+#define mem_heap_hi() persist_heap_hi()
+#define mem_heapsize() persist_heapsize()
+#endif
+
+#ifdef MM_RESERVE
+/* 保留的地址空间中[base, base + brk)是堆，[base, base + commit)可读写，commit按页对齐 */
+static struct {
+    char *base;
+    size_t brk, commit;
+    size_t dirty;//highest brk since these pages were last committed, memory above it is still zero
+} reserve = {0, 0, 0, 0};
+
+static int reserve_reset(void);
+static void *reserve_sbrk(long incr);
+static int heap_shrink(size_t pad);
+#define mem_sbrk(incr) reserve_sbrk(incr)
+#define mem_heap_lo() ((void *) reserve.base)
+#define mem_heap_hi() ((void *) (reserve.base + reserve.brk - 1))
+#define mem_heapsize() (reserve.brk)
+#endif
+
+/* 堆顶之上的内存从未交给过分配器，拓展得到的一定是全零的页 */
+#ifdef MM_RESERVE
+#define HEAP_FRESH_ZERO() (reserve.brk >= reserve.dirty)
+#else
+#define HEAP_FRESH_ZERO() 0
+#endif
+
+/* 提交和归还内存的单位，MM_HUGEPAGE时为大页 */
+#ifdef MM_HUGEPAGE
+#define TRIM_UNIT HUGE_PAGE_SIZE
+#else
+#define TRIM_UNIT mem_pagesize()
+#endif
+
+#ifdef MM_LATENCY
+static unsigned long lat_hist[LAT_OPS][64];//bucket b counts calls taking [2^(b-1), 2^b) units
+static unsigned long slow_counts[SLOW_EVENTS];
+
+#if !defined(__x86_64__) && !defined(__i386__)
+static inline unsigned long lat_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#endif
+
+static inline void lat_record(int op, unsigned long delta) {
+    int bucket = delta == 0 ? 0 : 64 - __builtin_clzl(delta);
+    __atomic_fetch_add(&lat_hist[op][bucket > 63 ? 63 : bucket], 1, __ATOMIC_RELAXED);
+}
+#endif
+
+#ifdef MM_PROFILE
+/* 同一调用栈的抽样分配，字节数是样本的请求大小之和，尚未按抽样率放大 */
+typedef struct prof_bucket {
+    unsigned long hash;
+    int depth;
+    void *stack[MM_PROF_DEPTH];
+    unsigned long allocs, frees;
+    size_t alloc_bytes, free_bytes;
+} prof_bucket_t;
+
+/* 一个使用中的样本，ptr为0表示空，为1表示已删除 */
+typedef struct prof_slot {
+    uintptr_t ptr;
+    unsigned int bucket;
+    size_t size;
+} prof_slot_t;
+
+static size_t prof_rate = MM_PROF_RATE;//0 turns sampling off
+static prof_bucket_t *prof_buckets = 0;
+static unsigned int *prof_bucket_index = 0;//bucket + 1, indexed by stack hash
+static size_t prof_nbuckets = 0, prof_bucket_cap = 0;
+static prof_slot_t *prof_live = 0;
+static size_t prof_live_cap = 0, prof_live_used = 0;//used counts deleted slots too
+static unsigned short prof_filter[1 << PROF_FILTER_SHIFT];//live samples hashing to each slot
+
+#ifdef MM_THREADS
+static __thread long prof_left = 0;//bytes until the next sample
+static __thread unsigned long prof_rng = 0;
+static __thread int prof_busy = 0;//set while recording, backtrace() may call malloc
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PROF_LOCK() pthread_mutex_lock(&prof_lock)
+#define PROF_UNLOCK() pthread_mutex_unlock(&prof_lock)
+#else
+static long prof_left = 0;
+static unsigned long prof_rng = 0;
+static int prof_busy = 0;
+#define PROF_LOCK()
+#define PROF_UNLOCK()
+#endif
+
+static void *prof_mmap(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* -ln(u)，u在(0, 1]，不依赖libm：ln(m * 2^e) = e * ln2 + 2 * atanh((m - 1) / (m + 1)) */
+static double prof_neg_log(double u) {
+    int e = 0;
+    while (u < 1.0) {
+        u *= 2;
+        e--;
+    }
+    double t = (u - 1) / (u + 1), t2 = t * t;
+    return -(e * 0.6931471805599453 + 2 * t * (1 + t2 / 3 + t2 * t2 / 5 + t2 * t2 * t2 / 7));
+}
+
+/* exp(-x)，x >= 0，先减半到很小再平方回去 */
+static double prof_exp_neg(double x) {
+    int k = 0;
+    if (x > 40)
+        return 0;
+    while (x > 0.125) {
+        x /= 2;
+        k++;
+    }
+    double r = 1 - x + x * x / 2 - x * x * x / 6 + x * x * x * x / 24;
+    while (k-- > 0)
+        r *= r;
+    return r;
+}
+
+/* 距离下一次抽样的字节数，服从均值为prof_rate的指数分布，抽样点因此构成泊松过程 */
+static long prof_next_interval(void) {
+    size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+    if (rate == 0)
+        return LONG_MAX;
+    prof_rng ^= prof_rng << 13;
+    prof_rng ^= prof_rng >> 7;
+    prof_rng ^= prof_rng << 17;
+    double u = ((prof_rng >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (long) (prof_neg_log(u) * rate) + 1;
+}
+
+/* 把抽样的count次、bytes字节放大为估计的分配量，每个样本代表size / (1 - exp(-size / rate))字节 */
+static size_t prof_scale(unsigned long count, size_t bytes) {
+    if (count == 0 || prof_rate == 0)
+        return bytes;
+    double avg = (double) bytes / count;
+    return (size_t) (bytes / (1 - prof_exp_neg(avg / prof_rate)));
+}
+
+static unsigned long prof_hash(void **stack, int depth) {
+    unsigned long h = 14695981039346656037UL;
+    for (int i = 0; i < depth; i++)
+        h = (h ^ (unsigned long) stack[i]) * 1099511628211UL;
+    return h;
+}
+
+/* 桶的数组和索引一起加倍，调用者需持有prof_lock */
+static int prof_grow_buckets(void) {
+    size_t cap = prof_bucket_cap ? prof_bucket_cap * 2 : 1024;
+    prof_bucket_t *b = prof_mmap(cap * sizeof(prof_bucket_t));
+    unsigned int *index = prof_mmap(2 * cap * sizeof(unsigned int));
+    if (b == NULL || index == NULL) {
+        if (b) munmap(b, cap * sizeof(prof_bucket_t));
+        if (index) munmap(index, 2 * cap * sizeof(unsigned int));
+        return 0;
+    }
+    for (size_t i = 0; i < prof_nbuckets; i++) {
+        b[i] = prof_buckets[i];
+        size_t j = b[i].hash & (2 * cap - 1);
+        while (index[j] != 0)
+            j = (j + 1) & (2 * cap - 1);
+        index[j] = i + 1;
+    }
+    if (prof_buckets != 0) {
+        munmap(prof_buckets, prof_bucket_cap * sizeof(prof_bucket_t));
+        munmap(prof_bucket_index, 2 * prof_bucket_cap * sizeof(unsigned int));
+    }
+    prof_buckets = b;
+    prof_bucket_index = index;
+    prof_bucket_cap = cap;
+    return 1;
+}
+
+/* 找到调用栈对应的桶，没有就新建，失败返回-1，调用者需持有prof_lock */
+static long prof_bucket_of(void **stack, int depth) {
+    unsigned long h = prof_hash(stack, depth);
+    if (prof_nbuckets == prof_bucket_cap && !prof_grow_buckets())
+        return -1;
+    size_t j = h & (2 * prof_bucket_cap - 1);
+    while (prof_bucket_index[j] != 0) {
+        prof_bucket_t *b = &prof_buckets[prof_bucket_index[j] - 1];
+        if (b->hash == h && b->depth == depth && memcmp(b->stack, stack, depth * sizeof(void *)) == 0)
+            return prof_bucket_index[j] - 1;
+        j = (j + 1) & (2 * prof_bucket_cap - 1);
+    }
+    prof_bucket_t *b = &prof_buckets[prof_nbuckets];
+    b->hash = h;
+    b->depth = depth;
+    memcpy(b->stack, stack, depth * sizeof(void *));
+    prof_bucket_index[j] = ++prof_nbuckets;
+    return prof_nbuckets - 1;
+}
+
+/* 装填率超过一半时加倍重建样本表，顺便清掉已删除的项，调用者需持有prof_lock */
+static int prof_grow_live(void) {
+    size_t cap = prof_live_cap ? prof_live_cap * 2 : 1024;
+    prof_slot_t *t = prof_mmap(cap * sizeof(prof_slot_t));
+    if (t == NULL)
+        return 0;
+    prof_live_used = 0;
+    for (size_t i = 0; i < prof_live_cap; i++) {
+        if (prof_live[i].ptr > 1) {
+            size_t j = PROF_FILTER_SLOT(prof_live[i].ptr) & (cap - 1);
+            while (t[j].ptr != 0)
+                j = (j + 1) & (cap - 1);
+            t[j] = prof_live[i];
+            prof_live_used++;
+        }
+    }
+    if (prof_live != 0)
+        munmap(prof_live, prof_live_cap * sizeof(prof_slot_t));
+    prof_live = t;
+    prof_live_cap = cap;
+    return 1;
+}
+
+/* 抽中了bp，记录调用栈，跳过本函数和分配函数自己的两层 */
+static void __attribute__((noinline)) prof_sample(void *bp, size_t size) {
+    void *stack[MM_PROF_DEPTH + 2];
+    if (prof_busy)
+        return;
+    prof_busy = 1;
+    if (prof_rng == 0) {
+        /* 线程的第一次调用先决定第一个抽样点，再看这次分配是否越过了它 */
+        prof_rng = ((unsigned long) &stack >> 4) * 0x9e3779b97f4a7c15UL | 1;
+        prof_left = prof_next_interval() - (long) size;
+        if (prof_left >= 0) {
+            prof_busy = 0;
+            return;
+        }
+    }
+    prof_left = prof_next_interval();
+    int depth = backtrace(stack, MM_PROF_DEPTH + 2) - 2;
+    if (depth < 0)
+        depth = 0;
+
+    PROF_LOCK();
+    long bucket = prof_bucket_of(stack + 2, depth);
+    if (bucket >= 0 && ((prof_live_used + 1) * 2 <= prof_live_cap || prof_grow_live())) {
+        size_t j = PROF_FILTER_SLOT(bp) & (prof_live_cap - 1);
+        while (prof_live[j].ptr > 1)
+            j = (j + 1) & (prof_live_cap - 1);
+        if (prof_live[j].ptr == 0)
+            prof_live_used++;
+        prof_live[j].ptr = (uintptr_t) bp;
+        prof_live[j].bucket = bucket;
+        prof_live[j].size = size;
+        prof_buckets[bucket].allocs++;
+        prof_buckets[bucket].alloc_bytes += size;
+        __atomic_fetch_add(&prof_filter[PROF_FILTER_SLOT(bp)], 1, __ATOMIC_RELAXED);
+    }
+    PROF_UNLOCK();
+    prof_busy = 0;
+}
+
+/* 过滤器表明bp可能被抽中过，在样本表中查找并删除 */
+static void prof_forget(void *bp) {
+    PROF_LOCK();
+    if (prof_live_cap != 0) {
+        size_t j = PROF_FILTER_SLOT(bp) & (prof_live_cap - 1);
+        while (prof_live[j].ptr != 0) {
+            if (prof_live[j].ptr == (uintptr_t) bp) {
+                prof_bucket_t *b = &prof_buckets[prof_live[j].bucket];
+                b->frees++;
+                b->free_bytes += prof_live[j].size;
+                prof_live[j].ptr = 1;
+                __atomic_fetch_sub(&prof_filter[PROF_FILTER_SLOT(bp)], 1, __ATOMIC_RELAXED);
+                break;
+            }
+            j = (j + 1) & (prof_live_cap - 1);
+        }
+    }
+    PROF_UNLOCK();
+}
+#endif
+
+/* 记录一次分配/释放，usable为payload的可用大小 */
+static inline void count_alloc(size_t usable) {
+#ifdef MM_THREADS
+    if (cur_arena == 0)
+        bind_arena();
+#endif
+    COUNT(nmalloc, 1);
+    COUNT(in_use, (long) usable);
+    COUNT(hist[SIZE_BUCKET(usable)], 1);
+}
+
+static inline void count_free(size_t usable) {
+#ifdef MM_THREADS
+    if (cur_arena == 0)
+        bind_arena();
+#endif
+    COUNT(nfree, 1);
+    COUNT(in_use, -(long) usable);
+    COUNT(hist[SIZE_BUCKET(usable)], -1);
+}
+
+static inline void count_realloc(void) {
+#ifdef MM_THREADS
+    if (cur_arena == 0)
+        bind_arena();
+#endif
+    COUNT(nrealloc, 1);
+}
+
+/* 原地改变大小，只调整使用中的字节数和直方图 */
+static inline void count_resize(size_t oldsize, size_t newsize) {
+    COUNT(in_use, (long) newsize - (long) oldsize);
+    COUNT(hist[SIZE_BUCKET(oldsize)], -1);
+    COUNT(hist[SIZE_BUCKET(newsize)], 1);
+}
+
+/* 大小到slab大小类的映射和每个slab中的对象个数 */
+static void slab_tables_init(void) {
+    for (int i = 0, cls = 0; i <= SLAB_MAX_SIZE / DSIZE; i++) {
+        if (i * DSIZE > slab_class_size[cls])
+            cls++;
+        slab_class_of[i] = cls;
+    }
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        slab_class_nobj[i] = (SLAB_SIZE - SLAB_HDR_SIZE) / slab_class_size[i];
+}
 
 /*
  * 初始化分配器，将virtual_NULL指向mem_heap_lo() (0x800000000)
  * 并不直接拓展heap，而是采取demang-extending，在需要的时候再拓展
  * root和header初始化为virtual_NULL，可以理解为空NULL
 */
-
 int mm_init(void) {
-    if ((heap_listp = mem_sbrk(6 * WSIZE)) == (void *) -1)
+#ifdef MM_RESERVE
+    if (reserve_reset() != 0)
+        return -1;
+#endif
+    if ((heap_listp = mem_sbrk(HEAP_PAD + PROLOGUE_SIZE)) == (void *) -1)
         return -1;
-    PUT(heap_listp + (2 * WSIZE), 0); /* Alignment padding */
-    PUT(heap_listp + (3 * WSIZE), PACK(DSIZE, STAT_ALLOC)); /* Prologue header */
-    PUT(heap_listp + (4 * WSIZE), PACK(DSIZE, STAT_ALLOC)); /* Prologue footer */
-    PUT(heap_listp + (5 * WSIZE), PACK(0, STAT_ALLOC | STAT_PREV_ALLOC)); /* Epilogue header */
-    heap_listp += (4 * WSIZE);
+    memset(heap_listp + (2 * WSIZE), 0, HEAP_PAD - 2 * WSIZE - HSIZE); /* Alignment padding */
+    PUT(heap_listp + (HEAP_PAD - HSIZE), PACK(PROLOGUE_SIZE, STAT_ALLOC)); /* Prologue header */
+    heap_listp += HEAP_PAD;
+    PUT(FTRP(heap_listp), PACK(PROLOGUE_SIZE, STAT_ALLOC)); /* Prologue footer */
+    PUT_HDRP(NEXT_BLKP(heap_listp), PACK(0, STAT_ALLOC | STAT_PREV_ALLOC)); /* Epilogue header */
     /*init the global variables*/
     virtual_NULL = (unsigned long)(mem_heap_lo());
-    root = (void *) virtual_NULL;
-    small_free_block_list = (void *) virtual_NULL;
+    for (int i = 0; i < NARENAS; i++)
+        arena_init(&arenas[i]);
+    memset(&tcache, 0, sizeof(tcache));
+    memset(slab_page_map, 0, sizeof(slab_page_map));
+    memset(short_page_map, 0, sizeof(short_page_map));
+    memset(&counters, 0, sizeof(counters));
+    footprint = peak_footprint = HEAP_PAD + PROLOGUE_SIZE;
+    slab_tables_init();
+    memset(chunk_owner, 0, sizeof(chunk_owner));
+    arenas[0].chunk_end = (char *) mem_heap_hi() + 1;
+    handle_top = 1;
+    handle_free = 0;
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
     //delay,demand-extending
     return 0;
 }
 
 /*
- * 这里是采用demand-extending的方式，需要多少空间申请多少空间
- * 先越过结尾块找到现有堆中最后一块，如果这一块是free的，那么就
- * 申请size-GET_SIZE(last_block)的空间，然后再合并就可以得到
- * size大小的空间
+ * 先越过结尾块找到现有堆中最后一块，如果这一块是free的，那么就
+ * 只需要size-GET_SIZE(last_block)的空间，然后再合并就可以得到
+ * size大小的空间。实际拓展的大小由grow_size决定，内存不足时退回到恰好需要的大小
+ */
+void *extend_heap(size_t words) {
+    void *bp;
+    size_t size = words;
+
+    HEAP_LOCK();
+    if (cur_arena->chunk_end != (char *) mem_heap_hi() + 1) {
+        size_t csize = grow_size(size);
+        if ((bp = new_chunk(csize)) == NULL)
+            bp = new_chunk(size);
+        HEAP_UNLOCK();
+        if (bp == NULL) return NULL;
+        insert_node(bp);
+        return bp;
+    }
+    void *last_block = mem_heap_hi() + 1 - HSIZE;
+    if (!PREV_ALLOC_R(last_block) && GET_SIZE(last_block) + MIN_BLOCK_SIZE <= size) {
+        size -= GET_SIZE(last_block);
+    }
+    size_t need = size;
+    size = grow_size(need);
+    int zero = HEAP_FRESH_ZERO();
+    if ((long) (bp = mem_sbrk(size)) == -1 && (size = need, (long) (bp = mem_sbrk(size)) == -1)) {
+        HEAP_UNLOCK();
+        return NULL;
+    }
+    cur_arena->extended += size;
+    footprint_add(size);
+    mark_chunk(bp, size);
+    cur_arena->chunk_end = (char *) bp + size;
+    HEAP_UNLOCK();
+
+    size_t flag = 0 | PREV_ALLOC(bp);
+    PUT_HDRP(bp, PACK(size, flag));
+    PUT_FTRP(bp, PACK(size, flag));
+    PUT_HDRP(NEXT_BLKP(bp), PACK(0, STAT_ALLOC));
+
+    /* 新的页全为零，前面的空闲块也全为零时，合并后清掉两者之间的FOOTER和HEADER即可 */
+    zero = zero && (PREV_ALLOC(bp) || IS_ZERO_BLOCK(PREV_BLKP(bp)));
+    void *temp = coalesce(bp);
+    if (zero) {
+        if (temp != bp) {
+            PUT(HDRP(bp), 0);
+            PUT(HDRP(bp) - HSIZE, 0);
+        }
+        PUT_FTRP(temp, GET(FTRP(temp)) | STAT_ZERO);
+    }
+    insert_node(temp);
+    return temp;
+}
+
+/*
+ * 计算一次拓展的大小。每grow_min字节给MM_GROW_WINDOW次分配的窗口，距离上次拓展的分配次数
+ * 少于窗口说明缺失频繁，大小加倍；超过16倍窗口说明需求已经平稳，大小减半。调用者需已进入arena
+ */
+static size_t grow_size(size_t size) {
+    arena_t *a = cur_arena;
+    unsigned long since = a->nalloc - a->last_extend;
+    unsigned long window = MM_GROW_WINDOW * (grow_min ? a->grow_chunk / grow_min : 1);
+    if (a->nextend != 0) {
+        if (since < window && a->grow_chunk < grow_max)
+            a->grow_chunk = MIN(a->grow_chunk * 2, grow_max);
+        else if (since > 16 * window && a->grow_chunk > grow_min)
+            a->grow_chunk = MAX(a->grow_chunk / 2, grow_min);
+    }
+    a->last_extend = a->nalloc;
+    a->nextend++;
+    SLOW_COUNT(SLOW_EXTEND, 1);
+    return MAX(size, ALIGN(a->grow_chunk));
+}
+
+/* 设置拓展大小的上下限，都为0时恢复为需要多少拓展多少 */
+void mm_set_growth(size_t min, size_t max) {
+    grow_min = min;
+    grow_max = MAX(min, max);
+    for (int i = 0; i < NARENAS; i++)
+        arenas[i].grow_chunk = grow_min;
+}
+
+/* 读取所有arena的拓展次数、拓展的总字节数，以及当前线程的arena下一次拓展的大小 */
+void mm_growth_stats(unsigned long *nextend, size_t *extended, size_t *chunk) {
+    *nextend = 0;
+    *extended = 0;
+    for (int i = 0; i < NARENAS; i++) {
+        *nextend += arenas[i].nextend;
+        *extended += arenas[i].extended;
+    }
+#ifdef MM_THREADS
+    *chunk = cur_arena != 0 ? cur_arena->grow_chunk : grow_min;
+#else
+    *chunk = cur_arena->grow_chunk;
+#endif
+}
+
+/* 堆和映射的总大小变化delta字节，同时更新峰值 */
+static void footprint_add(long delta) {
+    size_t now = __atomic_add_fetch(&footprint, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_footprint, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&peak_footprint, &peak, now, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* 把一组计数器加到st上 */
+static void stats_add(struct mm_stats *st, counters_t *c) {
+    st->nmalloc += __atomic_load_n(&c->nmalloc, __ATOMIC_RELAXED);
+    st->nfree += __atomic_load_n(&c->nfree, __ATOMIC_RELAXED);
+    st->nrealloc += __atomic_load_n(&c->nrealloc, __ATOMIC_RELAXED);
+    st->in_use += __atomic_load_n(&c->in_use, __ATOMIC_RELAXED);
+    for (int i = 0; i < 64; i++)
+        st->hist[i] += __atomic_load_n(&c->hist[i], __ATOMIC_RELAXED);
+}
+
+/*
+ * 读取各种统计信息，计数器(包括最大空闲块)都是随分配与释放更新的，这里只需要把每个arena和线程的计数相加
+ * 只有MM_TLSF删掉最大的块之后，在这里遍历最高的非空链表找新的最大块
+ */
+struct mm_stats mm_stats(void) {
+    struct mm_stats st;
+    memset(&st, 0, sizeof(st));
+    if (heap_listp == 0)
+        return st;
+    arena_t *self = cur_arena;
+    for (int i = 0; i < NARENAS; i++) {
+        cur_arena = &arenas[i];
+#ifdef MM_THREADS
+        pthread_mutex_lock(&cur_arena->lock);
+#endif
+        st.nextend += cur_arena->nextend;
+        st.free_bytes += cur_arena->free_bytes;
+        st.free_blocks += cur_arena->free_blocks;
+        st.bst_nodes += cur_arena->bst_nodes;
+        st.hanger_nodes += cur_arena->hanger_nodes;
+#ifdef MM_TLSF
+        if (cur_arena->largest_stale) {
+            cur_arena->largest_free = largest_free_block();
+            cur_arena->largest_stale = 0;
+        }
+#endif
+        st.largest_free = MAX(st.largest_free, cur_arena->largest_free);
+#ifdef MM_THREADS
+        pthread_mutex_unlock(&cur_arena->lock);
+#endif
+    }
+    cur_arena = self;
+#ifdef MM_THREADS
+    HEAP_LOCK();
+    stats_add(&st, &retired);
+    for (counters_t *c = counters_list; c != 0; c = c->next)
+        stats_add(&st, c);
+#else
+    stats_add(&st, &counters);
+#endif
+    st.heap_size = mem_heapsize();
+    st.mapped = __atomic_load_n(&footprint, __ATOMIC_RELAXED) - st.heap_size;
+    st.peak = __atomic_load_n(&peak_footprint, __ATOMIC_RELAXED);
+    HEAP_UNLOCK();
+    if (st.free_bytes != 0)
+        st.fragmentation = 1.0 - (double) st.largest_free / st.free_bytes;
+    return st;
+}
+
+#ifdef MM_LATENCY
+/* 读取op的第bucket个桶，即耗时在[2^(bucket-1), 2^bucket)个LAT_UNIT之间的调用次数 */
+unsigned long mm_latency_bucket(int op, int bucket) {
+    if (op < 0 || op >= LAT_OPS || bucket < 0 || bucket >= 64)
+        return 0;
+    return __atomic_load_n(&lat_hist[op][bucket], __ATOMIC_RELAXED);
+}
+
+unsigned long mm_slowpath_count(int event) {
+    if (event < 0 || event >= SLOW_EVENTS)
+        return 0;
+    return __atomic_load_n(&slow_counts[event], __ATOMIC_RELAXED);
+}
+
+void mm_latency_reset(void) {
+    for (int i = 0; i < LAT_OPS; i++)
+        for (int b = 0; b < 64; b++)
+            __atomic_store_n(&lat_hist[i][b], 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < SLOW_EVENTS; i++)
+        __atomic_store_n(&slow_counts[i], 0, __ATOMIC_RELAXED);
+}
+
+/* 信号处理函数中不能用stdio，自己格式化 */
+static char *lat_put(char *p, const char *s) {
+    while (*s)
+        *p++ = *s++;
+    return p;
+}
+
+static char *lat_put_num(char *p, unsigned long n) {
+    char digits[20];
+    int k = 0;
+    do {
+        digits[k++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    while (k > 0)
+        *p++ = digits[--k];
+    return p;
+}
+
+/* 第一个累计次数超过total * permille / 1000的桶的上界 */
+static unsigned long lat_percentile(unsigned long *hist, unsigned long total, int permille) {
+    unsigned long sum = 0;
+    for (int b = 0; b < 64; b++) {
+        sum += hist[b];
+        if (sum * 1000 > total * permille)
+            return b == 0 ? 0 : b >= 63 ? ~0UL : 1UL << b;
+    }
+    return ~0UL;
+}
+
+/* 把直方图的百分位数和慢路径计数写到fd，只用write，可以在信号处理函数中调用 */
+void mm_latency_dump(int fd) {
+    static const char *op_names[LAT_OPS] = {"malloc", "free", "realloc", "find_fit", "extend_heap"};
+    static const char *event_names[SLOW_EVENTS] = {"tree_walks", "tree_steps", "coalesce_0",
+        "coalesce_1", "coalesce_2", "coalesce_3", "extend", "remote_free"};
+    char buf[256], *p;
+
+    p = lat_put(buf, "op count p50 p99 p99.9 (" LAT_UNIT ", upper bound of the bucket)\n");
+    if (write(fd, buf, p - buf) < 0)
+        return;
+    for (int i = 0; i < LAT_OPS; i++) {
+        unsigned long hist[64], total = 0;
+        for (int b = 0; b < 64; b++)
+            total += hist[b] = __atomic_load_n(&lat_hist[i][b], __ATOMIC_RELAXED);
+        if (total == 0)
+            continue;
+        p = lat_put(buf, op_names[i]);
+        p = lat_put_num(lat_put(p, " "), total);
+        p = lat_put_num(lat_put(p, " "), lat_percentile(hist, total, 500));
+        p = lat_put_num(lat_put(p, " "), lat_percentile(hist, total, 990));
+        p = lat_put_num(lat_put(p, " "), lat_percentile(hist, total, 999));
+        p = lat_put(p, "\n");
+        if (write(fd, buf, p - buf) < 0)
+            return;
+    }
+    for (int i = 0; i < SLOW_EVENTS; i++) {
+        p = lat_put(buf, event_names[i]);
+        p = lat_put_num(lat_put(p, " "), __atomic_load_n(&slow_counts[i], __ATOMIC_RELAXED));
+        p = lat_put(p, "\n");
+        if (write(fd, buf, p - buf) < 0)
+            return;
+    }
+}
+
+static void lat_signal_handler(int signo) {
+    (void) signo;
+    mm_latency_dump(2);
+}
+
+/* 收到signo时把统计写到标准错误，比如mm_latency_signal(SIGUSR1)后kill -USR1 pid */
+int mm_latency_signal(int signo) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lat_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    return sigaction(signo, &sa, NULL);
+}
+#endif
+
+#ifdef MM_PROFILE
+/* 设置平均抽样间隔，0关闭抽样。当前线程立即生效，其它线程在下一次抽样之后生效 */
+void mm_set_profile_rate(size_t rate) {
+    __atomic_store_n(&prof_rate, rate, __ATOMIC_RELAXED);
+    if (prof_rng != 0)
+        prof_left = prof_next_interval();
+}
+
+/* 把buf中的len字节全部写到fd */
+static int prof_write(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * 输出剖析结果，成功返回0
+ * MM_PROF_PPROF是pprof能读的旧版heap格式，每行是一个调用栈"使用中的个数: 字节 [累计个数: 字节] @ 地址..."，
+ * 头部的heap_v2/rate让pprof自己按抽样率放大，末尾附上/proc/self/maps用于符号化；
+ * 折叠栈格式每行是"根;...;叶 字节"，字节已经放大为估计值，地址可以用addr2line换成函数名
+ * 格式化只用栈上的缓冲区，不会再进入malloc
+ */
+int mm_heap_profile_dump(int fd, int format) {
+    char line[64 + MM_PROF_DEPTH * 20];
+    int n, ret = 0;
+
+    prof_busy = 1;
+    PROF_LOCK();
+    if (format == MM_PROF_PPROF) {
+        unsigned long live = 0, allocs = 0;
+        size_t live_bytes = 0, alloc_bytes = 0;
+        for (size_t i = 0; i < prof_nbuckets; i++) {
+            live += prof_buckets[i].allocs - prof_buckets[i].frees;
+            live_bytes += prof_buckets[i].alloc_bytes - prof_buckets[i].free_bytes;
+            allocs += prof_buckets[i].allocs;
+            alloc_bytes += prof_buckets[i].alloc_bytes;
+        }
+        n = snprintf(line, sizeof(line), "heap profile: %lu: %zu [%lu: %zu] @ heap_v2/%zu\n",
+                     live, live_bytes, allocs, alloc_bytes, prof_rate);
+        ret |= prof_write(fd, line, n);
+    }
+    for (size_t i = 0; i < prof_nbuckets && ret == 0; i++) {
+        prof_bucket_t *b = &prof_buckets[i];
+        unsigned long live = b->allocs - b->frees;
+        size_t live_bytes = b->alloc_bytes - b->free_bytes;
+        if (format == MM_PROF_PPROF) {
+            n = snprintf(line, sizeof(line), "%lu: %zu [%lu: %zu] @", live, live_bytes,
+                         b->allocs, b->alloc_bytes);
+            for (int k = 0; k < b->depth; k++)
+                n += snprintf(line + n, sizeof(line) - n, " %p", b->stack[k]);
+            n += snprintf(line + n, sizeof(line) - n, "\n");
+        } else {
+            size_t bytes = format == MM_PROF_FOLDED ? prof_scale(live, live_bytes)
+                                                    : prof_scale(b->allocs, b->alloc_bytes);
+            if (bytes == 0)
+                continue;
+            n = 0;
+            for (int k = b->depth - 1; k >= 0; k--)
+                n += snprintf(line + n, sizeof(line) - n, k ? "%p;" : "%p", b->stack[k]);
+            n += snprintf(line + n, sizeof(line) - n, " %zu\n", bytes);
+        }
+        ret |= prof_write(fd, line, n);
+    }
+    PROF_UNLOCK();
+
+    if (format == MM_PROF_PPROF && ret == 0) {
+        char buf[4096];
+        ssize_t len;
+        int maps = open("/proc/self/maps", O_RDONLY);
+        ret |= prof_write(fd, "\nMAPPED_LIBRARIES:\n", 19);
+        while (maps >= 0 && ret == 0 && (len = read(maps, buf, sizeof(buf))) > 0)
+            ret |= prof_write(fd, buf, len);
+        if (maps >= 0)
+            close(maps);
+    }
+    prof_busy = 0;
+    return ret;
+}
+#endif
+
+/* 将[start, start + len)所在的ARENA_UNIT都记为当前arena所有 */
+static void mark_chunk(void *start, size_t len) {
+    unsigned long first = ((unsigned long) start - virtual_NULL) >> ARENA_UNIT_SHIFT;
+    unsigned long last = ((unsigned long) start + len - 1 - virtual_NULL) >> ARENA_UNIT_SHIFT;
+    for (unsigned long i = first; i <= last; i++)
+        chunk_owner[i] = (unsigned char) (cur_arena - arenas);
+}
+
+/*
+ * 当前arena不在堆顶时不能原地拓展，从堆顶切出一个新的chunk，起始地址向ARENA_UNIT对齐，
+ * 保证每个ARENA_UNIT只属于一个arena，对齐跳过的部分由give_pad还给堆顶的arena。chunk开头留出与序言块
+ * 同样大小的填充，第一个块的PREV_ALLOC置位，末尾是结尾块，所以合并永远不会越过chunk
+ * 调用时持有heap_lock
+ */
+static void *new_chunk(size_t size) {
+    char *top = (char *) mem_heap_hi() + 1;
+    size_t pad = (virtual_NULL - (unsigned long) top) & (ARENA_UNIT - 1);
+    size_t csize = (size + PROLOGUE_SIZE + ARENA_UNIT - 1) & ~(ARENA_UNIT - 1);
+    size_t zero = HEAP_FRESH_ZERO() ? STAT_ZERO : 0;
+    char *base;
+
+    if ((long) (base = mem_sbrk(pad + csize)) == -1)
+        return NULL;
+    base += pad;
+    if (pad >= MIN_BLOCK_SIZE)
+        give_pad(top, pad);
+    cur_arena->extended += pad + csize;
+    footprint_add(pad + csize);
+    void *bp = base + PROLOGUE_SIZE;
+    PUT_HDRP(bp, PACK(csize - PROLOGUE_SIZE, STAT_PREV_ALLOC));
+    PUT_FTRP(bp, PACK(csize - PROLOGUE_SIZE, STAT_PREV_ALLOC | zero));
+    PUT_HDRP(NEXT_BLKP(bp), PACK(0, STAT_ALLOC));
+    mark_chunk(base, csize);
+    cur_arena->chunk_end = base + csize;
+    return bp;
+}
+
+#ifdef MM_THREADS
+/* 线程退出时把tcache还给arena，计数并入retired，并解除与arena的绑定 */
+static void arena_release(void *arena) {
+    arena_enter();
+    tcache_flush();
+    arena_leave();
+    HEAP_LOCK();
+    ((arena_t *) arena)->nthreads--;
+    for (counters_t **pp = &counters_list; *pp != 0; pp = &(*pp)->next) {
+        if (*pp == &counters) {
+            *pp = counters.next;
+            break;
+        }
+    }
+    retired.nmalloc += counters.nmalloc;
+    retired.nfree += counters.nfree;
+    retired.nrealloc += counters.nrealloc;
+    retired.in_use += counters.in_use;
+    for (int i = 0; i < 64; i++)
+        retired.hist[i] += counters.hist[i];
+    memset(&counters, 0, sizeof(counters));
+    HEAP_UNLOCK();
+}
+
+static void heap_init_once(void) {
+    pthread_key_create(&arena_key, arena_release);
+    if (heap_listp == 0)
+        mm_init();
+}
+
+/* 第一次调用malloc/free的线程绑定到当前线程数最少的arena，并登记自己的计数器 */
+static void bind_arena(void) {
+    arena_t *best = &arenas[0];
+    HEAP_LOCK();
+    for (int i = 1; i < MM_MAX_ARENAS; i++)
+        if (arenas[i].nthreads < best->nthreads)
+            best = &arenas[i];
+    best->nthreads++;
+    counters.next = counters_list;
+    counters_list = &counters;
+    HEAP_UNLOCK();
+    cur_arena = best;
+    pthread_setspecific(arena_key, best);
+}
+
+/* 其它线程释放的块不能直接操作所属arena的BST，压入该arena的无锁栈即可 */
+static void remote_free(arena_t *owner, void *bp) {
+    void *head = __atomic_load_n(&owner->remote_free_list, __ATOMIC_RELAXED);
+    do {
+        *(void **) bp = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote_free_list, &head, bp, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* 一次取走整个栈，在持有arena锁时逐个释放 */
+static void drain_remote_frees(void) {
+    void *bp = __atomic_exchange_n(&cur_arena->remote_free_list, 0, __ATOMIC_ACQUIRE);
+    while (bp != 0) {
+        void *next = *(void **) bp;
+        if (IS_SLAB(bp))
+            slab_free(bp);
+        else
+            free_block(bp);
+        bp = next;
+    }
+}
+#endif
+
+/*
+ * 对齐时跳过的[top, top + pad)与堆顶的chunk在同一个ARENA_UNIT中，把它作为一个块接在那段chunk末尾，
+ * 交给堆顶的arena释放，与那里最后的空闲块合并。其它线程的arena不能直接操作，压入它的无锁栈
+ */
+static void give_pad(char *top, size_t pad) {
+    arena_t *owner = OWNER_OF(top);
+    PUT_HDRP(top, PACK(pad, STAT_ALLOC | PREV_ALLOC(top)));
+    PUT_HDRP(top + pad, PACK(0, STAT_ALLOC | STAT_PREV_ALLOC));
+#ifdef MM_THREADS
+    remote_free(owner, top);
+#else
+    arena_t *self = cur_arena;
+    cur_arena = owner;
+    free_block(top);
+    cur_arena = self;
+#endif
+}
+
+/*
+ * 把载体块carrier开头的len字节(整数个页)作为ARENA_SHORT的一段chunk，返回其中唯一的空闲块
+ * 与new_chunk相同，开头留出序言块大小的填充，第一个块的PREV_ALLOC置位，结尾块落在载体的payload中，
+ * 所以合并不会越过这段chunk。调用者需已进入ARENA_SHORT
+ */
+static void *short_chunk_add(char *carrier, size_t len) {
+    void *bp = carrier + PROLOGUE_SIZE;
+    mark_pages(short_page_map, carrier, len >> SLAB_SHIFT, 1);
+    cur_arena->carved += len;
+    PUT_HDRP(bp, PACK(len - PROLOGUE_SIZE, STAT_PREV_ALLOC));
+    PUT_FTRP(bp, PACK(len - PROLOGUE_SIZE, STAT_PREV_ALLOC));
+    PUT_HDRP(NEXT_BLKP(bp), PACK(0, STAT_ALLOC));
+    insert_node(bp);
+    return bp;
+}
+
+/*
+ * 合并后的空闲块bp占满了ARENA_SHORT的一段chunk(前一页不属于ARENA_SHORT，后面是结尾块)时，
+ * 清除页表，把载体交还给它所在的arena并返回1，与give_pad一样，其它线程的arena压入它的无锁栈
+ */
+static int short_chunk_release(char *bp) {
+    char *carrier = bp - PROLOGUE_SIZE;
+    if (IS_SHORT(carrier - 1) || GET_SIZE(NEXT_BLKP(bp)) != 0)
+        return 0;
+    size_t len = GET_SIZE(bp) + PROLOGUE_SIZE;
+    mark_pages(short_page_map, carrier, len >> SLAB_SHIFT, 0);
+    cur_arena->carved -= len;
+    arena_t *owner = OWNER_OF(carrier);
+#ifdef MM_THREADS
+    remote_free(owner, carrier);
+#else
+    arena_t *self = cur_arena;
+    cur_arena = owner;
+    free_block(carrier);
+    cur_arena = self;
+#endif
+    return 1;
+}
+
+static void arena_init(void *arena) {
+    arena_t *a = arena;
+    a->root = (void *) virtual_NULL;
+    a->small_free_block_list = (void *) virtual_NULL;
+    memset(a->partial, 0, sizeof(a->partial));
+    a->empty = 0;
+    a->grow_chunk = grow_min;
+    a->nalloc = a->last_extend = a->nextend = 0;
+    a->extended = a->carved = a->free_bytes = a->largest_free = 0;
+    a->free_blocks = a->bst_nodes = a->hanger_nodes = 0;
+#ifdef MM_TLSF
+    a->fl_bitmap = 0;
+    a->largest_stale = 0;
+    memset(a->sl_bitmap, 0, sizeof(a->sl_bitmap));
+    for (int fl = 0; fl < TLSF_FL_COUNT; fl++)
+        for (int sl = 0; sl < TLSF_SL_COUNT; sl++)
+            a->free_lists[fl][sl] = (void *) virtual_NULL;
+#endif
+#ifdef MM_BTREE
+    /* 重新初始化时保留已经映射的叶子和数组 */
+    for (size_t i = 0; i < a->bt_nleaves; i++) {
+        a->bt_leaves[i]->keys[0] = (unsigned long) a->bt_spare;
+        a->bt_spare = a->bt_leaves[i];
+    }
+    a->bt_nleaves = 0;
+#endif
+#ifdef MM_THREADS
+    pthread_mutex_init(&a->lock, NULL);
+    a->remote_free_list = 0;
+    a->nthreads = 0;
+#endif
+    a->chunk_end = 0;
+    a->compact_at = a->compact_trim = 0;
+}
+
+/* 进入当前线程的arena：必要时先绑定，然后加锁并处理其它线程交还的块 */
+static inline void arena_enter(void) {
+#ifdef MM_THREADS
+    if (cur_arena == 0)
+        bind_arena();
+    pthread_mutex_lock(&cur_arena->lock);
+    if (__atomic_load_n(&cur_arena->remote_free_list, __ATOMIC_RELAXED) != 0)
+        drain_remote_frees();
+#endif
+#ifdef MM_PERSIST
+    /* 所有修改堆的操作都先进入arena */
+    if (persist.synced)
+        persist_dirty();
+#endif
+}
+
+static inline void arena_leave(void) {
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&cur_arena->lock);
+#endif
+}
+
+/* 临时进入另一个arena a，返回原来的arena，用完后交给arena_return恢复 */
+static inline arena_t *arena_borrow(arena_t *a) {
+#ifdef MM_THREADS
+    if (cur_arena == 0)
+        bind_arena();
+#endif
+    arena_t *self = cur_arena;
+    cur_arena = a;
+    arena_enter();
+    return self;
+}
+
+static inline void arena_return(arena_t *self) {
+    arena_leave();
+    cur_arena = self;
+}
+
+/* 在slab的链表头插入/删除 */
+static inline void slab_push(slab_t **list, slab_t *slab) {
+    slab->prev = 0;
+    slab->next = *list;
+    if (*list != 0)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static inline void slab_unlink(slab_t **list, slab_t *slab) {
+    if (slab->prev != 0)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next != 0)
+        slab->next->prev = slab->prev;
+}
+
+/* 将页表map中从start开始的npages个页置位(或清除) */
+static void mark_pages(unsigned char *map, void *start, unsigned long npages, int set) {
+    for (unsigned long page = SLAB_PAGE(start); npages > 0; page++, npages--) {
+        if (set)
+            __atomic_fetch_or(&map[page >> 3], 1 << (page & 7), __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_and(&map[page >> 3], ~(1 << (page & 7)), __ATOMIC_RELAXED);
+    }
+}
+
+/* 从堆中申请SLAB_RUN个页对齐的slab，多申请一页用于对齐，全部放入空slab链表 */
+static int slab_run_new(void) {
+    char *block = block_alloc(ALIGN((SLAB_RUN + 1) * SLAB_SIZE + HSIZE), NULL);
+    if (block == 0)
+        return -1;
+    slab_t *first = SLAB_OF(block + SLAB_SIZE - 1);
+    first->block = block;
+    first->live = 0;
+    for (int i = SLAB_RUN - 1; i >= 0; i--) {
+        slab_t *slab = (slab_t *) ((char *) first + i * SLAB_SIZE);
+        slab->first = first;
+        slab->cls = SLAB_EMPTY;
+        slab_push(&cur_arena->empty, slab);
+    }
+    mark_pages(slab_page_map, first, SLAB_RUN, 1);
+    return 0;
+}
+
+/* 整段slab都不再使用时，把它们从空slab链表中摘下，整块还给堆 */
+static void slab_run_release(slab_t *first) {
+    for (int i = 0; i < SLAB_RUN; i++)
+        slab_unlink(&cur_arena->empty, (slab_t *) ((char *) first + i * SLAB_SIZE));
+    mark_pages(slab_page_map, first, SLAB_RUN, 0);
+    free_block(first->block);
+}
+
+/* 从大小类cls中分配一个对象，部分空闲的slab用完时再取一个空slab */
+static void *slab_alloc(int cls) {
+    slab_t *slab = cur_arena->partial[cls];
+    if (slab == 0) {
+        if (cur_arena->empty == 0 && slab_run_new() < 0)
+            return NULL;
+        slab = cur_arena->empty;
+        slab_unlink(&cur_arena->empty, slab);
+        slab->cls = cls;
+        slab->nfree = slab_class_nobj[cls];
+        memset(slab->bitmap, 0, sizeof(slab->bitmap));
+        for (int i = 0; i < slab->nfree; i++)
+            slab->bitmap[i / 64] |= 1UL << (i % 64);
+        slab->first->live++;
+        slab_push(&cur_arena->partial[cls], slab);
+    }
+    int word = 0;
+    while (slab->bitmap[word] == 0)
+        word++;
+    int index = word * 64 + __builtin_ctzl(slab->bitmap[word]);
+    slab->bitmap[word] &= slab->bitmap[word] - 1;
+    if (--slab->nfree == 0)
+        slab_unlink(&cur_arena->partial[cls], slab);
+    return (char *) slab + SLAB_HDR_SIZE + index * slab_class_size[cls];
+}
+
+/* 释放slab中的对象，slab由地址直接得到；slab全空时放回空slab链表 */
+static void slab_free(void *p) {
+    slab_t *slab = SLAB_OF(p);
+    int cls = slab->cls;
+    int index = ((char *) p - (char *) slab - SLAB_HDR_SIZE) / slab_class_size[cls];
+    slab->bitmap[index / 64] |= 1UL << (index % 64);
+    if (++slab->nfree == 1)
+        slab_push(&cur_arena->partial[cls], slab);
+    if (slab->nfree == slab_class_nobj[cls]) {
+        slab_unlink(&cur_arena->partial[cls], slab);
+        slab->cls = SLAB_EMPTY;
+        slab_push(&cur_arena->empty, slab);
+        if (--slab->first->live == 0)
+            slab_run_release(slab->first);
+    }
+}
+
+/*
+ * 分配算法，小请求交给tcache和slab，其余分配的块大小向WSIZE对齐，注意最小块是2*DSIZE的，所以不足时需要补齐
+ * 如果没有能从heap中找到合适的块，再对堆扩展
+ */
+
+static inline void *do_malloc(size_t size) {
+    size_t asize;      /* Adjusted block size */
+    char *bp;
+
+#ifdef MM_THREADS
+    pthread_once(&heap_once, heap_init_once);
+#else
+    if (heap_listp == 0){
+        mm_init();
+    }
+#endif
+    /* Ignore spurious requests */
+    if (size == 0)
+        return NULL;
+
+    if (size <= SLAB_MAX_SIZE) {
+        int cls = slab_class_of[(size + DSIZE - 1) / DSIZE];
+#if TCACHE_DEPTH > 0
+        if (tcache.bins[cls] != 0) {
+            bp = tcache.bins[cls];
+            tcache.bins[cls] = *(void **) bp;
+            tcache.counts[cls]--;
+            tcache.total--;
+            count_alloc(slab_class_size[cls]);
+            return bp;
+        }
+#endif
+        arena_enter();
+        bp = slab_alloc(cls);
+        arena_leave();
+        if (bp)
+            count_alloc(slab_class_size[cls]);
+        return bp;
+    }
+    if (size >= mmap_threshold) {
+        if ((bp = mmap_alloc(size)) != NULL)
+            count_alloc(usable_size(bp));
+        return bp;
+    }
+
+    /*  Adjust block size to include overhead and alignment reqs. */
+    //plus HSIZE for we omit the footer of allocated block
+    asize = ALIGN(size + HSIZE);
+    asize = MAX(asize, MIN_BLOCK_SIZE);
+    arena_enter();
+    bp = block_alloc(asize, NULL);
+    arena_leave();
+    if (bp)
+        count_alloc(GET_SIZE(bp) - HSIZE);
+    return bp;
+}
+
+void *malloc(size_t size) {
+    void *bp;
+    LAT_TIME(LAT_MALLOC, bp = do_malloc(size));
+    PROF_ALLOC(bp, size);
+    return bp;
+}
+
+/*
+ * 在当前arena中分配一个大小为asize的块，调用者需已进入arena
+ * zero不为NULL时，原来的空闲块已知为零则置为其大小(没有分割时FOOTER落在payload中)，否则置0
+ */
+static void *block_alloc(size_t asize, size_t *zero) {
+    char *bp;
+
+    cur_arena->nalloc++;
+    LAT_TIME(LAT_FIND_FIT, bp = find_fit(asize));
+    if (bp == (void *) virtual_NULL) {
+        /* No fit found. Get more memory and place the block */
+        LAT_TIME(LAT_EXTEND_HEAP, bp = extend_heap(asize));
+        if (bp == NULL)
+            return NULL;
+    }
+    if (zero != NULL)
+        *zero = IS_ZERO_BLOCK(bp) ? GET_SIZE(bp) : 0;
+    place(bp, asize);
+    return bp;
+}
+
+/*
+ * 在当前arena中分配payload按alignment对齐、大小为asize的块，调用者需已进入arena
+ * 多找alignment + MIN_BLOCK_SIZE字节，保证对齐地址之前的部分要么为空，要么能成为一个空闲块，
+ * 这一部分放回空闲结构，对齐的块再由shrink_block分割掉多余的尾部
+ */
+static void *aligned_block_alloc(size_t alignment, size_t asize) {
+    size_t need = asize + alignment + MIN_BLOCK_SIZE;
+    char *bp, *abp;
+
+    cur_arena->nalloc++;
+    LAT_TIME(LAT_FIND_FIT, bp = find_fit(need));
+    if (bp == (void *) virtual_NULL) {
+        LAT_TIME(LAT_EXTEND_HEAP, bp = extend_heap(need));
+        if (bp == NULL)
+            return NULL;
+    }
+    abp = (char *) (((unsigned long) bp + alignment - 1) & ~(alignment - 1));
+    if (abp == bp) {
+        place(bp, asize);
+        return bp;
+    }
+    if (abp - bp < MIN_BLOCK_SIZE)
+        abp += alignment;
+
+    size_t csize = GET_SIZE(bp);
+    size_t lead = abp - bp;
+    delete_node(bp);
+    PUT_HDRP(bp, PACK(lead, PREV_ALLOC(bp)));
+    PUT_FTRP(bp, PACK(lead, PREV_ALLOC(bp)));
+    PUT_HDRP(abp, PACK(csize - lead, STAT_ALLOC));
+    insert_node(bp);
+    shrink_block(abp, asize);
+    return abp;
+}
+
+/*
+ * 按alignment对齐分配，alignment必须是2的幂
+ * 不超过DSIZE时与malloc相同，否则不经过slab和mmap，直接从堆中切出对齐的块
+ * 堆中的payload都按ALIGNMENT对齐，对齐地址与块的起点之差总是块大小的整数倍
+ */
+void *memalign(size_t alignment, size_t size) {
+    void *bp;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= DSIZE)
+        return malloc(size);
+#ifdef MM_THREADS
+    pthread_once(&heap_once, heap_init_once);
+#else
+    if (heap_listp == 0)
+        mm_init();
+#endif
+    if (size == 0)
+        return NULL;
+    if (size > MAX_HEAP_SIZE || alignment > MAX_HEAP_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t asize = MAX(ALIGN(size + HSIZE), MIN_BLOCK_SIZE);
+    arena_enter();
+    bp = aligned_block_alloc(alignment, asize);
+    arena_leave();
+    if (bp)
+        count_alloc(GET_SIZE(bp) - HSIZE);
+    PROF_ALLOC(bp, size);
+    return bp;
+}
+
+/* POSIX接口，alignment还必须是sizeof(void *)的倍数，失败时返回错误码且不修改*memptr */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+    void *bp = memalign(alignment, size);
+    if (bp == NULL)
+        return ENOMEM;
+    *memptr = bp;
+    return 0;
+}
+
+/* C11接口 */
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+/*
+ * 分配nmemb * size字节并清零，乘法溢出时失败。slab对象直接memset，mmap的块本来就是全零的页；
+ * 堆中的块由block_alloc分配，原来的空闲块已知为零时只清掉残留的链接字和FOOTER
+ */
+static void *do_calloc(size_t nmemb, size_t size) {
+    size_t total, zero;
+    char *bp;
+
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (total <= SLAB_MAX_SIZE || total >= mmap_threshold) {
+        /* 比SLAB_MAX_SIZE大的只能是mmap的块 */
+        if ((bp = do_malloc(total)) != NULL && total <= SLAB_MAX_SIZE)
+            memset(bp, 0, total);
+        return bp;
+    }
+#ifdef MM_THREADS
+    pthread_once(&heap_once, heap_init_once);
+#else
+    if (heap_listp == 0)
+        mm_init();
+#endif
+    size_t asize = MAX(ALIGN(total + HSIZE), MIN_BLOCK_SIZE);
+    arena_enter();
+    bp = block_alloc(asize, &zero);
+    arena_leave();
+    if (bp == NULL)
+        return NULL;
+    count_alloc(GET_SIZE(bp) - HSIZE);
+    if (!zero) {
+        memset(bp, 0, total);
+    } else {
+        memset(bp, 0, FREE_LINK_SIZE);
+        if (GET_SIZE(bp) == zero)
+            PUT(bp + zero - 2 * HSIZE, 0);//the old footer, now inside the payload
+    }
+    return bp;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *bp;
+    LAT_TIME(LAT_MALLOC, bp = do_calloc(nmemb, size));
+    PROF_ALLOC(bp, nmemb * size);
+    return bp;
+}
+
+/*
+ * 短命的堆块在ARENA_SHORT中分配，slab和mmap的块本来就与其它块分开，提示对它们不起作用
+ * ARENA_SHORT中没有合适的块时，从当前线程的arena分配页对齐的载体，这期间不持有ARENA_SHORT的锁。
+ * 载体相当于ARENA_SHORT的一次拓展，此前ARENA_SHORT中的分配次数记到那个arena上，grow_size据此判断缺失是否频繁
+ */
+static void *do_malloc_hint(size_t size, int hint) {
+    void *bp;
+
+    if (hint != MM_HINT_SHORT || size <= SLAB_MAX_SIZE || size >= mmap_threshold || mem_heapsize() < SHORT_MIN_HEAP)
+        return do_malloc(size);
+#ifdef MM_THREADS
+    pthread_once(&heap_once, heap_init_once);
+#else
+    if (heap_listp == 0)
+        mm_init();
+#endif
+    size_t asize = MAX(ALIGN(size + HSIZE), MIN_BLOCK_SIZE);
+    arena_t *self = arena_borrow(&arenas[ARENA_SHORT]);
+    if (find_fit(asize) != (void *) virtual_NULL) {
+        bp = block_alloc(asize, NULL);
+    } else {
+        size_t need = (asize + PROLOGUE_SIZE + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1);
+        size_t len = MAX(need, MIN(MAX(cur_arena->carved, SHORT_CHUNK_MIN), SHORT_CHUNK_MAX));
+        unsigned long served = cur_arena->nalloc - cur_arena->last_extend;
+        cur_arena->last_extend = cur_arena->nalloc;
+        arena_return(self);
+        arena_enter();
+        cur_arena->nalloc += served;
+        if (len > need && find_fit(ALIGN(len + HSIZE) + SLAB_SIZE + MIN_BLOCK_SIZE) == (void *) virtual_NULL)
+            len = need;
+        char *carrier = aligned_block_alloc(SLAB_SIZE, ALIGN(len + HSIZE));
+        arena_leave();
+        self = arena_borrow(&arenas[ARENA_SHORT]);
+        bp = carrier != NULL ? short_chunk_add(carrier, len) : NULL;
+        if (bp != NULL) {
+            cur_arena->nalloc++;
+            place(bp, asize);
+        }
+    }
+    arena_return(self);
+    if (bp)
+        count_alloc(GET_SIZE(bp) - HSIZE);
+    return bp;
+}
+
+/* 按块的预期寿命分配，MM_HINT_LONG与malloc相同 */
+void *mm_malloc_hint(size_t size, int hint) {
+    void *bp;
+    LAT_TIME(LAT_MALLOC, bp = do_malloc_hint(size, hint));
+    PROF_ALLOC(bp, size);
+    return bp;
+}
+
+/*
+ * 一次分配n个块，结果写入out，返回成功分配的个数
+ * 普通大小的块只做一次find_fit和一次place，得到的块再按顺序切成n份，多出的尾部并入最后一块；
+ * slab和mmap大小的请求以及找不到连续空间时逐个分配
+ */
+size_t mm_malloc_batch(const size_t sizes[], size_t n, void *out[]) {
+    size_t total = 0, done = 0;
+    char *bp = NULL;
+
+#ifdef MM_THREADS
+    pthread_once(&heap_once, heap_init_once);
+#else
+    if (heap_listp == 0)
+        mm_init();
+#endif
+    for (size_t i = 0; i < n; i++) {
+        out[i] = NULL;
+        if (sizes[i] > SLAB_MAX_SIZE && sizes[i] < mmap_threshold)
+            total += MAX(ALIGN(sizes[i] + HSIZE), MIN_BLOCK_SIZE);
+    }
+    if (total != 0 && total < MAX_HEAP_SIZE) {
+        arena_enter();
+        if ((bp = block_alloc(total, NULL)) != NULL) {
+            size_t flag = PREV_ALLOC(bp), left = GET_SIZE(bp);
+            for (size_t i = 0; i < n; i++) {
+                if (sizes[i] <= SLAB_MAX_SIZE || sizes[i] >= mmap_threshold)
+                    continue;
+                size_t asize = MAX(ALIGN(sizes[i] + HSIZE), MIN_BLOCK_SIZE);
+                total -= asize;
+                if (total == 0)
+                    asize = left;
+                PUT_HDRP(bp, PACK(asize, STAT_ALLOC | flag));
+                flag = STAT_PREV_ALLOC;
+                out[i] = bp;
+                left -= asize;
+                bp += asize;
+            }
+        }
+        arena_leave();
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (out[i] != NULL)
+            count_alloc(GET_SIZE(out[i]) - HSIZE);
+        else
+            out[i] = do_malloc(sizes[i]);
+        if (out[i] != NULL)
+            done++;
+        PROF_ALLOC(out[i], sizes[i]);
+    }
+    return done;
+}
+
+/* 释放之前申请的内存空间，小对象先放入tcache，其它线程的块交还给所属的arena */
+static inline void do_free(void *bp) {
+    if (bp == 0)
+        return;
+
+    int slab = IS_SLAB(bp);
+    count_free(usable_size(bp));
+#if TCACHE_DEPTH > 0
+    /* tcache只在绑定了arena的线程中使用，线程退出时由arena_key的析构函数清空，否则其中的对象会泄漏 */
+#ifdef MM_THREADS
+    if (slab && cur_arena != 0) {
+#else
+    if (slab) {
+#endif
+        int cls = SLAB_OF(bp)->cls;
+        if (tcache.counts[cls] < TCACHE_DEPTH) {
+            *(void **) bp = tcache.bins[cls];
+            tcache.bins[cls] = bp;
+            tcache.counts[cls]++;
+            tcache.total++;
+            return;
+        }
+    }
+#endif
+    if (!slab && IS_MMAPPED(bp)) {
+        footprint_add(-(long) MMAP_LEN(bp));
+        munmap((char *) bp - MMAP_HDR_SIZE, MMAP_LEN(bp));
+        return;
+    }
+
+    arena_t *owner = OWNER_OF(bp);
+    if (owner == &arenas[ARENA_SHORT]) {
+        /* 短命块的arena不属于任何线程，直接加锁释放 */
+        arena_t *self = arena_borrow(owner);
+        free_block(bp);
+        arena_return(self);
+        return;
+    }
+#ifdef MM_THREADS
+    if (owner != cur_arena) {
+        SLOW_COUNT(SLOW_REMOTE_FREE, 1);
+        remote_free(owner, bp);
+        return;
+    }
+#endif
+    arena_enter();
+    if (slab)
+        slab_free(bp);
+    else
+        free_block(bp);
+    arena_leave();
+}
+
+void free(void *bp) {
+    PROF_FREE(bp);
+    LAT_TIME(LAT_FREE, do_free(bp));
+}
+
+static int cmp_ptr(const void *a, const void *b) {
+    unsigned long x = *(unsigned long *) a, y = *(unsigned long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * 一次释放n个块，ptrs会按地址排序
+ * 属于当前arena(或ARENA_SHORT)的相邻块连成一段，整段当作一个块释放，只合并和插入一次；
+ * 地址相邻的块属于同一个arena时只加一次锁，其它块逐个释放
+ */
+void mm_free_batch(void *ptrs[], size_t n) {
+    arena_t *held = 0, *self = 0;
+
+    if (n == 0 || heap_listp == 0)
+        return;
+#ifdef MM_THREADS
+    if (cur_arena == 0)
+        bind_arena();
+#endif
+    qsort(ptrs, n, sizeof(void *), cmp_ptr);
+    for (size_t i = 0; i < n; ) {
+        char *bp = ptrs[i++];
+        if (bp == NULL)
+            continue;
+        PROF_FREE(bp);
+        arena_t *owner = IS_SLAB(bp) || IS_MMAPPED(bp) ? 0 : OWNER_OF(bp);
+        if (owner != held) {
+            if (held != 0)
+                arena_return(self);
+            held = 0;
+            if (owner != 0 && (owner == cur_arena || owner == &arenas[ARENA_SHORT])) {
+                self = arena_borrow(owner);
+                held = owner;
+            }
+        }
+        if (held == 0) {
+            do_free(bp);
+            continue;
+        }
+        count_free(GET_SIZE(bp) - HSIZE);
+        char *end = NEXT_BLKP(bp);
+        while (i < n && ptrs[i] == end) {
+            PROF_FREE(end);
+            count_free(GET_SIZE(end) - HSIZE);
+            end = NEXT_BLKP(end);
+            i++;
+        }
+        PUT_HDRP(bp, PACK(end - bp, STAT_ALLOC | PREV_ALLOC(bp)));
+        COMPACT_ABSORB(bp);
+        free_block(bp);
+    }
+    if (held != 0)
+        arena_return(self);
+}
+
+/* 合并之后再插入合适的链表中，调用者需已进入块所属的arena */
+static void free_block(void *bp) {
+    size_t size = GET_SIZE(bp);
+    size_t checkalloc = GET_ALLOC(bp);
+    if (checkalloc == 0) return;
+    size_t flag = 0 | PREV_ALLOC(bp);
+    PUT_HDRP(bp, PACK(size, flag));
+    PUT_FTRP(bp, PACK(size, flag));
+
+    char *lo = bp;
+    bp = coalesce(bp);
+    if (cur_arena == &arenas[ARENA_SHORT] && short_chunk_release(bp))
+        return;
+    /* ARENA_SHORT中的空间很快又会被用到，自动归还只会反复缺页，交给mm_trim处理 */
+    if (GET_SIZE(bp) >= trim_threshold && cur_arena != &arenas[ARENA_SHORT])
+        release_freed(bp, lo, size);
+    insert_node(bp);
+}
+
+/* 把tcache中的对象还给slab，调用者需已进入当前线程的arena */
+static void tcache_flush(void) {
+    for (int i = 0; i < SLAB_CLASSES && tcache.total != 0; i++) {
+        void *bp = tcache.bins[i];
+        while (bp != 0) {
+            void *next = *(void **) bp;
+#ifdef MM_THREADS
+            arena_t *owner = OWNER_OF(bp);
+            if (owner != cur_arena)
+                remote_free(owner, bp);
+            else
+#endif
+                slab_free(bp);
+            bp = next;
+        }
+        tcache.bins[i] = 0;
+        tcache.total -= tcache.counts[i];
+        tcache.counts[i] = 0;
+    }
+}
+
+/* 将当前线程tcache中缓存的对象全部还给slab */
+void mm_tcache_flush(void) {
+    if (heap_listp == 0 || tcache.total == 0)
+        return;
+    arena_enter();
+    tcache_flush();
+    arena_leave();
+}
+
+/*
+ * 直接映射size字节，映射的开头依次是映射长度、魔数、填充和HEADER，
+ * HEADER中只有STAT_ALLOC，大小为0，payload保持DSIZE对齐
+ */
+static void *mmap_alloc(size_t size) {
+    size_t len = (size + MMAP_HDR_SIZE + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    void *bp = base + MMAP_HDR_SIZE;
+    MMAP_LEN(bp) = len;
+    MMAP_MAGIC(bp) = MMAP_MAGIC_WORD;
+    PUT_HDRP(bp, STAT_ALLOC);
+    footprint_add(len);
+    return bp;
+}
+
+/* 用mremap改变映射的长度，内核只移动页表，不复制数据 */
+static void *mmap_realloc(void *bp, size_t size) {
+    size_t len = (size + MMAP_HDR_SIZE + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if (len == MMAP_LEN(bp))
+        return bp;
+#ifdef MREMAP_MAYMOVE
+    char *base = mremap((char *) bp - MMAP_HDR_SIZE, MMAP_LEN(bp), len, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED)
+        return NULL;
+    bp = base + MMAP_HDR_SIZE;
+    footprint_add((long) len - (long) MMAP_LEN(bp));
+    MMAP_LEN(bp) = len;
+    return bp;
+#else
+    return NULL;
+#endif
+}
+
+/* 设置mmap阈值，不小于该大小的请求直接映射 */
+void mm_set_mmap_threshold(size_t threshold) {
+#ifdef MM_PERSIST
+    /* 映射的块不在堆文件中 */
+    if (persist.hdr != 0)
+        return;
+#endif
+    mmap_threshold = threshold;
+}
+
+/*
+ * 归还空闲块bp中落在[lo, hi)内的整页，块开头的链接字和结尾的FOOTER不能动，
+ * 之后再访问这些页时内核给出全零的页。有页被归还时返回1
+ */
+static int release_pages(void *bp, char *lo, char *hi) {
+    size_t page = TRIM_UNIT;
+    char *start = (char *) bp + FREE_LINK_SIZE;
+    char *end = (char *) FTRP(bp);
+    if (lo < start) lo = start;
+    if (hi > end) hi = end;
+    lo = (char *) (((unsigned long) lo + page - 1) & ~(page - 1));
+    hi = (char *) ((unsigned long) hi & ~(page - 1));
+    if (lo >= hi)
+        return 0;
+    return madvise(lo, hi - lo, MADV_DONTNEED) == 0;
+}
+
+/*
+ * 从lo开始的size字节释放后合并成了不小于trim_threshold的空闲块bp，归还新释放的部分，
+ * 合并进来的相邻空闲块若小于阈值，它们的页还没有归还过，一并归还
+ */
+static void release_freed(void *bp, char *lo, size_t size) {
+    char *start = bp, *end = (char *) bp + GET_SIZE(bp);
+    char *hi = lo + size;
+    if ((size_t) (lo - start) >= trim_threshold)
+        start = lo;
+    if ((size_t) (end - hi) >= trim_threshold)
+        end = hi;
+    release_pages(bp, start, end);
+}
+
+/* 归还一个空闲块的整页，紧挨着堆顶的块保留开头的pad字节 */
+static int trim_block(void *bp, size_t pad) {
+    char *lo = bp;
+    if ((char *) HDRP(NEXT_BLKP(bp)) == (char *) mem_heap_hi() + 1 - HSIZE)
+        lo += pad;
+    return release_pages(bp, lo, (char *) FTRP(bp));
+}
+
+/* 设置自动归还的阈值 */
+void mm_set_trim_threshold(size_t threshold) {
+    trim_threshold = threshold;
+}
+
+/*
+ * 把所有arena中空闲块的整页归还给内核，堆顶保留pad字节
+ * mem_sbrk不能缩小堆，所以堆顶的空闲块同样用madvise归还，地址空间保留以便再次拓展；
+ * MM_RESERVE时先把堆顶的空闲块缩到pad字节，其后的页不再提交
+ * 有页被归还时返回1，否则返回0
+ */
+int mm_trim(size_t pad) {
+    int released = 0;
+    if (heap_listp == 0)
+        return 0;
+    arena_t *self = cur_arena;
+    for (int i = 0; i < NARENAS; i++) {
+        cur_arena = &arenas[i];
+#ifdef MM_THREADS
+        pthread_mutex_lock(&cur_arena->lock);
+#endif
+#ifdef MM_RESERVE
+        released |= heap_shrink(pad);
+#endif
+        released |= trim_free_blocks(pad);
+#ifdef MM_THREADS
+        pthread_mutex_unlock(&cur_arena->lock);
+#endif
+    }
+    cur_arena = self;
+    return released;
+}
+
+/* 可用的payload大小，slab对象为其大小类，mmap块为映射长度减去开头，普通块为块大小减去HEADER */
+static size_t usable_size(void *ptr) {
+    if (IS_SLAB(ptr))
+        return slab_class_size[SLAB_OF(ptr)->cls];
+    if (IS_MMAPPED(ptr))
+        return MMAP_LEN(ptr) - MMAP_HDR_SIZE;
+    return GET_SIZE(ptr) - HSIZE;
+}
+
+/* 将已分配的块bp截成asize，剩下的部分足够大时作为空闲块释放 */
+static void shrink_block(void *bp, size_t asize) {
+    size_t csize = GET_SIZE(bp);
+    if (csize - asize < MIN_BLOCK_SIZE)
+        return;
+    PUT_HDRP(bp, PACK(asize, STAT_ALLOC | PREV_ALLOC(bp)));
+
+    char *temp = NEXT_BLKP(bp);
+    PUT_HDRP(temp, PACK(csize - asize, STAT_PREV_ALLOC));
+    PUT_FTRP(temp, PACK(csize - asize, STAT_PREV_ALLOC));
+    void *merged = coalesce(temp);
+    if (GET_SIZE(merged) >= trim_threshold)
+        release_freed(merged, temp, csize - asize);
+    insert_node(merged);
+}
+
+/*
+ * 尝试原地重新分配，分为四种情况
+ * 1.缩小，直接分割出尾部
+ * 2.块紧挨着结尾块，先拓展堆，使后面出现一个空闲块
+ * 3.后面的空闲块加上当前块足够大，合并后再分割
+ * 4.前面(以及后面)的空闲块加上当前块足够大，合并后把数据前移
+ * 都不满足时返回NULL，调用者需已进入块所属的arena
+ */
+static void *realloc_in_place(void *bp, size_t asize) {
+    size_t csize = GET_SIZE(bp);
+    void *next = NEXT_BLKP(bp);
+
+    if (asize <= csize) {
+        shrink_block(bp, asize);
+        return bp;
+    }
+    if (GET_SIZE(next) == 0 && HDRP(next) == (char *) mem_heap_hi() + 1 - HSIZE)
+        LAT_TIME(LAT_EXTEND_HEAP, extend_heap(MAX(asize - csize, MIN_BLOCK_SIZE)));
+
+    size_t nsize = GET_ALLOC(next) ? 0 : GET_SIZE(next);
+    if (csize + nsize >= asize) {
+        delete_node(next);
+        PUT_HDRP(bp, PACK(csize + nsize, STAT_ALLOC | PREV_ALLOC(bp)));
+        COMPACT_ABSORB(bp);
+        shrink_block(bp, asize);
+        return bp;
+    }
+    if (!PREV_ALLOC(bp)) {
+        void *prev = PREV_BLKP(bp);
+        size_t psize = GET_SIZE(prev);
+        if (psize + csize + nsize >= asize) {
+            size_t flag = PREV_ALLOC(prev);
+            delete_node(prev);
+            if (nsize)
+                delete_node(next);
+            memmove(prev, bp, csize - HSIZE);
+            PUT_HDRP(prev, PACK(psize + csize + nsize, STAT_ALLOC | flag));
+            COMPACT_ABSORB(prev);
+            shrink_block(prev, asize);
+            return prev;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * 重新分配
+ * slab对象在大小类足够时不动，mmap块仍然足够大时用mremap，普通块先尝试原地缩小或扩大
+ * 若不然则重新分配并复制
+ */
+static inline void *do_realloc(void *ptr, size_t size) {
+    size_t oldsize;
+    void *newptr;
+    /* If size == 0 then this is just free, and we return NULL. */
+    if (size == 0) {
+        do_free(ptr);
+        return 0;
+    }
+    /* If oldptr is NULL, then this is just malloc. */
+    if (ptr == NULL) {
+        return do_malloc(size);
+    }
+    oldsize = usable_size(ptr);
+    count_realloc();
+    if (IS_SLAB(ptr)) {
+        if (size <= oldsize)
+            return ptr;
+    }
+    else if (IS_MMAPPED(ptr)) {
+        if (size >= mmap_threshold && (newptr = mmap_realloc(ptr, size)) != NULL) {
+            count_resize(oldsize, usable_size(newptr));
+            return newptr;
+        }
+    }
+    else if (OWNER_OF(ptr) == cur_arena || OWNER_OF(ptr) == &arenas[ARENA_SHORT]) {
+        size_t asize = MAX(ALIGN(size + HSIZE), MIN_BLOCK_SIZE);
+        arena_t *self = arena_borrow(OWNER_OF(ptr));
+        newptr = realloc_in_place(ptr, asize);
+        arena_return(self);
+        if (newptr) {
+            count_resize(oldsize, GET_SIZE(newptr) - HSIZE);
+            return newptr;
+        }
+    }
+    /* 短命块移动后仍然是短命块 */
+    if (!IS_SLAB(ptr) && !IS_MMAPPED(ptr) && OWNER_OF(ptr) == &arenas[ARENA_SHORT])
+        newptr = do_malloc_hint(size, MM_HINT_SHORT);
+    else
+        newptr = do_malloc(size);
+    /* If realloc() fails the original block is left untouched  */
+    if (!newptr) {
+        return 0;
+    }
+    if (size < oldsize) oldsize = size;
+    memcpy(newptr, ptr, oldsize);
+    do_free(ptr);
+    return newptr;
+}
+
+/* 剖析时realloc看作释放旧块再分配新块，失败时旧块的样本也丢掉了 */
+void *realloc(void *ptr, size_t size) {
+    void *newptr;
+    PROF_FREE(ptr);
+    LAT_TIME(LAT_REALLOC, newptr = do_realloc(ptr, size));
+    PROF_ALLOC(newptr, size);
+    return newptr;
+}
+
+/* 区域的chunk，数据紧跟在头部之后，头部大小保持ALIGNMENT对齐 */
+typedef struct region_chunk {
+    struct region_chunk *next;
+    size_t size;//bytes of data after the header
+} region_chunk_t;
+#define REGION_HDR_SIZE ALIGN(sizeof(region_chunk_t))
+
+/* 区域，cur和end是第一个chunk中尚未分配的部分 */
+struct mm_arena {
+    region_chunk_t *chunks;//most recent chunk first
+    char *cur, *end;
+    size_t chunk_size;
+};
+
+/* 创建区域，chunk_size为0时使用MM_REGION_CHUNK，第一个chunk在第一次分配时才申请 */
+struct mm_arena *mm_arena_create(size_t chunk_size) {
+    struct mm_arena *ar = malloc(sizeof(struct mm_arena));
+    if (ar == NULL)
+        return NULL;
+    ar->chunks = NULL;
+    ar->cur = ar->end = NULL;
+    ar->chunk_size = chunk_size ? MAX(ALIGN(chunk_size), 2 * REGION_HDR_SIZE) : MM_REGION_CHUNK;
+    return ar;
+}
+
+/* 申请一个至少有size字节数据的chunk，放在链表头部并成为当前chunk */
+static void *region_new_chunk(struct mm_arena *ar, size_t size) {
+    region_chunk_t *c = malloc(REGION_HDR_SIZE + size);
+    if (c == NULL)
+        return NULL;
+    c->next = ar->chunks;
+    c->size = size;
+    ar->chunks = c;
+    ar->cur = (char *) c + REGION_HDR_SIZE;
+    ar->end = ar->cur + size;
+    return ar->cur;
+}
+
+/*
+ * 从区域中分配size字节，按ALIGNMENT对齐，只需要移动cur
+ * 当前chunk不够时申请新的chunk，当前chunk剩下的部分就浪费了；
+ * 大的请求单独占一个chunk，挂在当前chunk之后，当前chunk继续使用
+ */
+void *mm_arena_alloc(struct mm_arena *ar, size_t size) {
+    void *p;
+
+    if (size == 0 || size > MAX_HEAP_SIZE)
+        return NULL;
+    size = ALIGN(size);
+    if ((size_t) (ar->end - ar->cur) >= size) {
+        p = ar->cur;
+        ar->cur += size;
+        return p;
+    }
+    if (size > ar->chunk_size / 4 && ar->chunks != NULL) {
+        region_chunk_t *c = malloc(REGION_HDR_SIZE + size);
+        if (c == NULL)
+            return NULL;
+        c->next = ar->chunks->next;
+        c->size = size;
+        ar->chunks->next = c;
+        return (char *) c + REGION_HDR_SIZE;
+    }
+    if ((p = region_new_chunk(ar, MAX(size, ar->chunk_size - REGION_HDR_SIZE))) == NULL)
+        return NULL;
+    ar->cur += size;
+    return p;
+}
+
+/* 释放区域中的所有分配，交还除最近一个chunk之外的所有chunk，留下的chunk供下一轮使用 */
+void mm_arena_reset(struct mm_arena *ar) {
+    region_chunk_t *c = ar->chunks, *next;
+    if (c == NULL)
+        return;
+    for (next = c->next; next != NULL; ) {
+        region_chunk_t *t = next->next;
+        free(next);
+        next = t;
+    }
+    c->next = NULL;
+    ar->cur = (char *) c + REGION_HDR_SIZE;
+    ar->end = ar->cur + c->size;
+}
+
+/* 交还所有chunk并释放区域本身 */
+void mm_arena_destroy(struct mm_arena *ar) {
+    if (ar == NULL)
+        return;
+    for (region_chunk_t *c = ar->chunks, *next; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(ar);
+}
+
+/* 对象池的slab头部，对象从first开始连续排列，bump之后的对象还从未分配过 */
+typedef struct pool_slab {
+    struct pool_slab *next, *prev;//list of slabs with free objects, or all slabs when full
+    void *free_list;//freed objects, linked through their first word
+    char *bump, *end;
+    size_t live;//objects handed out
+} pool_slab_t;
+
+struct mm_pool {
+    pool_slab_t *partial;//slabs with free objects
+    pool_slab_t *full;
+    size_t object_size, slab_size;
+    size_t first;//offset of the first object in a slab
+};
+
+#define POOL_SLAB_OF(pool, p) ((pool_slab_t *) ((unsigned long)(p) & ~((pool)->slab_size - 1)))
+
+/*
+ * 创建对象大小为object_size、按align对齐的池，align为0时按DSIZE对齐，必须是2的幂
+ * 对象大小向align取整，至少能放下一个指针
+ */
+struct mm_pool *mm_pool_create(size_t object_size, size_t align) {
+    struct mm_pool *pool;
+
+    if (align == 0)
+        align = DSIZE;
+    if ((align & (align - 1)) != 0 || object_size == 0 || object_size > MAX_HEAP_SIZE / POOL_MIN_OBJECTS)
+        return NULL;
+    if ((pool = malloc(sizeof(struct mm_pool))) == NULL)
+        return NULL;
+    pool->partial = pool->full = NULL;
+    pool->object_size = (MAX(object_size, sizeof(void *)) + align - 1) & ~(align - 1);
+    pool->first = (sizeof(pool_slab_t) + align - 1) & ~(align - 1);
+    pool->slab_size = MM_POOL_SLAB;
+    while (pool->slab_size < pool->first + POOL_MIN_OBJECTS * pool->object_size)
+        pool->slab_size <<= 1;
+    return pool;
+}
+
+static void pool_unlink(pool_slab_t **list, pool_slab_t *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+}
+
+static void pool_push(pool_slab_t **list, pool_slab_t *s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list)
+        (*list)->prev = s;
+    *list = s;
+}
+
+/* 先用slab中释放过的对象，再按地址顺序切出新的对象，slab用满后移到full链表 */
+void *mm_pool_alloc(struct mm_pool *pool) {
+    pool_slab_t *s = pool->partial;
+    void *p;
+
+    if (s == NULL) {
+        if ((s = memalign(pool->slab_size, pool->slab_size)) == NULL)
+            return NULL;
+        s->free_list = NULL;
+        s->bump = (char *) s + pool->first;
+        s->end = (char *) s + pool->slab_size;
+        s->live = 0;
+        pool_push(&pool->partial, s);
+    }
+    if (s->free_list != NULL) {
+        p = s->free_list;
+        s->free_list = *(void **) p;
+    } else {
+        p = s->bump;
+        s->bump += pool->object_size;
+    }
+    s->live++;
+    if (s->free_list == NULL && s->bump + pool->object_size > s->end) {
+        pool_unlink(&pool->partial, s);
+        pool_push(&pool->full, s);
+    }
+    return p;
+}
+
+/*
+ * 归还对象，原本满的slab回到partial链表；slab全空并且还有别的partial slab时交还给堆，
+ * 保留一个空的slab，避免在边界上反复申请和释放
+ */
+void mm_pool_free(struct mm_pool *pool, void *p) {
+    if (p == NULL)
+        return;
+    pool_slab_t *s = POOL_SLAB_OF(pool, p);
+    int was_full = s->free_list == NULL && s->bump + pool->object_size > s->end;
+
+    *(void **) p = s->free_list;
+    s->free_list = p;
+    s->live--;
+    if (was_full) {
+        pool_unlink(&pool->full, s);
+        pool_push(&pool->partial, s);
+    }
+    if (s->live == 0 && (s->next != NULL || s->prev != NULL)) {
+        pool_unlink(&pool->partial, s);
+        free(s);
+    }
+}
+
+/* 交还所有slab并释放池本身，池中尚未归还的对象随之失效 */
+void mm_pool_destroy(struct mm_pool *pool) {
+    if (pool == NULL)
+        return;
+    for (int i = 0; i < 2; i++) {
+        for (pool_slab_t *s = i ? pool->full : pool->partial, *next; s != NULL; s = next) {
+            next = s->next;
+            free(s);
+        }
+    }
+    free(pool);
+}
+
+/* 第一次使用时为句柄表保留地址空间，调用时持有heap_lock */
+static int handles_init(void) {
+    if (handles == 0) {
+        void *p = mmap(NULL, MM_MAX_HANDLES * sizeof(handle_t), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return 0;
+        handles = p;
+    }
+    return 1;
+}
+
+/* 句柄块的payload以句柄号开头，句柄表中记录的恰好是bp时bp才是句柄块 */
+#define HANDLE_OF(p) GET_LINK(p)
+#define IS_HANDLE_BLOCK(p) (HANDLE_OF(p) < handle_top && handles[HANDLE_OF(p)].bp == (char *) (p))
+
+static void handle_put(mm_handle_t h) {
+    HEAP_LOCK();
+    handles[h].next = handle_free;
+    handle_free = h;
+    HEAP_UNLOCK();
+}
+
+/*
+ * 分配一个可以移动的对象，返回句柄，失败时返回0
+ * 块总是在当前arena的堆中分配，不用slab或mmap，这样mm_compact才能移动它
+ */
+mm_handle_t mm_halloc(size_t size) {
+    mm_handle_t h = 0;
+    char *bp;
+
+#ifdef MM_THREADS
+    pthread_once(&heap_once, heap_init_once);
+#else
+    if (heap_listp == 0)
+        mm_init();
+#endif
+    if (size >= MAX_HEAP_SIZE)
+        return 0;
+    size_t asize = MAX(ALIGN(size + ALIGNMENT + HSIZE), MIN_BLOCK_SIZE);
+    HEAP_LOCK();
+    if (!handles_init())
+        h = 0;
+    else if (handle_free != 0) {
+        h = handle_free;
+        handle_free = handles[h].next;
+    }
+    else if (handle_top < MM_MAX_HANDLES)
+        h = handle_top++;
+    HEAP_UNLOCK();
+    if (h == 0)
+        return 0;
+
+    arena_enter();
+    if ((bp = block_alloc(asize, NULL)) != NULL) {
+        PUT_LINK(bp, h);
+        handles[h].pins = 0;
+        __atomic_store_n(&handles[h].bp, bp, __ATOMIC_RELAXED);
+    }
+    arena_leave();
+    if (bp == NULL) {
+        handle_put(h);
+        return 0;
+    }
+    count_alloc(GET_SIZE(bp) - HSIZE);
+    return h;
+}
+
+/*
+ * 固定句柄h的对象并返回它的地址，到对应的mm_hunpin为止对象不会被移动，可以嵌套
+ * 对象只会在所属arena的chunk内移动，所以移动前后OWNER_OF相同，加的是同一把锁
+ */
+void *mm_hpin(mm_handle_t h) {
+    if (h == 0)
+        return NULL;
+    handle_t *e = &handles[h];
+    arena_t *self = arena_borrow(OWNER_OF(__atomic_load_n(&e->bp, __ATOMIC_RELAXED)));
+    e->pins++;
+    char *p = e->bp + ALIGNMENT;
+    arena_return(self);
+    return p;
+}
+
+void mm_hunpin(mm_handle_t h) {
+    if (h == 0)
+        return;
+    handle_t *e = &handles[h];
+    arena_t *self = arena_borrow(OWNER_OF(__atomic_load_n(&e->bp, __ATOMIC_RELAXED)));
+    e->pins--;
+    arena_return(self);
+}
+
+void mm_hfree(mm_handle_t h) {
+    if (h == 0)
+        return;
+    handle_t *e = &handles[h];
+    arena_t *self = arena_borrow(OWNER_OF(__atomic_load_n(&e->bp, __ATOMIC_RELAXED)));
+    char *bp = e->bp;
+    __atomic_store_n(&e->bp, NULL, __ATOMIC_RELAXED);
+    count_free(GET_SIZE(bp) - HSIZE);
+    free_block(bp);
+    arena_return(self);
+    handle_put(h);
+}
+
+/*
+ * 当前arena从第unit个ARENA_UNIT起的第一段chunk中的第一个块，没有时返回NULL
+ * 除了堆开头的一段，每段chunk都从ARENA_UNIT对齐的地址开始，并以结尾块结束
+ */
+static char *compact_run(unsigned long unit) {
+    char *bp = NULL;
+
+    HEAP_LOCK();
+    unsigned long last = ((unsigned long) mem_heap_hi() - virtual_NULL) >> ARENA_UNIT_SHIFT;
+    for (; unit <= last; unit++) {
+        if (&arenas[chunk_owner[unit]] == cur_arena) {
+            bp = unit == 0 ? NEXT_BLKP(heap_listp) : (char *) virtual_NULL + (unit << ARENA_UNIT_SHIFT) + PROLOGUE_SIZE;
+            break;
+        }
+    }
+    HEAP_UNLOCK();
+    return bp;
+}
+
+/*
+ * 把句柄块bp移到它前面的空闲块的开头，空闲块换到它后面并与后面的空闲块合并，返回块的新地址
+ * 调用者需已进入arena
+ */
+static char *compact_slide(char *bp) {
+    char *prev = PREV_BLKP(bp);
+    size_t psize = GET_SIZE(prev), size = GET_SIZE(bp);
+    size_t flag = PREV_ALLOC(prev);
+
+    delete_node(prev);
+    memmove(prev, bp, size - HSIZE);
+    PUT_HDRP(prev, PACK(size, STAT_ALLOC | flag));
+    __atomic_store_n(&handles[HANDLE_OF(prev)].bp, prev, __ATOMIC_RELAXED);
+
+    char *next = NEXT_BLKP(prev);
+    PUT_HDRP(next, PACK(psize, STAT_PREV_ALLOC));
+    PUT_FTRP(next, PACK(psize, STAT_PREV_ALLOC));
+    insert_node(coalesce(next));
+    return prev;
+}
+
+/*
+ * 从高地址向低地址归还chunk末尾空闲块tail中至多len字节(至少一页)的整页，尾部还没有全部归还时返回1
+ * 两次调用之间tail可能被分配或合并，已归还的位置不在tail内时从头开始
+ */
+static int compact_release(char *tail, size_t len) {
+    size_t page = TRIM_UNIT;
+    char *end = (char *) FTRP(tail), *hi = cur_arena->compact_trim;
+
+    if (hi <= tail || hi > end)
+        hi = end;
+    char *lo = (size_t) (hi - tail) > MAX(len, page) ? (char *) ((unsigned long) (hi - MAX(len, page)) & ~(page - 1)) : tail;
+    if (lo < tail)
+        lo = tail;
+    release_pages(tail, lo, hi);
+    cur_arena->compact_trim = lo;
+    return lo > tail;
+}
+
+/*
+ * 对当前arena做一段增量压缩，检查和移动的代价合计约为budget字节，至少处理一个块，
+ * 本轮还没有走完时返回1，走完时返回0，下次调用开始新的一轮
+ * 未被固定的句柄块前面是空闲块时就前移，空闲空间随之后移，到达chunk末尾时归还其中的整页
+ * 本次调用遇到的第一个块不论大小都可以移动，所以budget小于块大小时也总能前进
+ */
+int mm_compact(size_t budget) {
+    size_t spent = 0;
+
+    if (heap_listp == 0 || handles == 0)
+        return 0;
+    arena_enter();
+    char *bp = cur_arena->compact_at != 0 ? cur_arena->compact_at : compact_run(0);
+    while (bp != NULL && (spent == 0 || spent < budget)) {
+        size_t size = GET_SIZE(bp);
+        spent += COMPACT_VISIT_COST;
+        if (size == 0) {
+            /* 结尾块，前面的空闲块就是压缩出来的尾部，归还也按budget分几次做 */
+            if (!PREV_ALLOC(bp) && compact_release(PREV_BLKP(bp), budget > spent ? budget - spent : 0))
+                break;
+            cur_arena->compact_trim = 0;
+            bp = compact_run((((unsigned long) bp - 1 - virtual_NULL) >> ARENA_UNIT_SHIFT) + 1);
+            continue;
+        }
+        if (GET_ALLOC(bp) && !PREV_ALLOC(bp) && IS_HANDLE_BLOCK(bp) && handles[HANDLE_OF(bp)].pins == 0) {
+            /* 剩余的budget不够移动这个块时停在这里，下次调用从它开始 */
+            if (spent != COMPACT_VISIT_COST && spent + size > budget)
+                break;
+            bp = compact_slide(bp);
+            spent += size;
+        }
+        bp = NEXT_BLKP(bp);
+    }
+    cur_arena->compact_at = bp;
+    arena_leave();
+    return bp != NULL;
+}
+
+#ifdef MM_RESERVE
+/* 把[p, p + len)重新映射为PROT_NONE，其中的页和提交量都还给内核，新的映射需要重新标记大页 */
+static int reserve_decommit(char *p, size_t len) {
+    void *q = mmap(p, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if (q == MAP_FAILED)
+        return -1;
+#ifdef MM_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#endif
+    return 0;
+}
+
+/* 第一次调用时保留地址空间，之后(重新mm_init时)清空整个堆 */
+static int reserve_reset(void) {
+    if (reserve.base == 0) {
+#ifdef MM_HUGEPAGE
+        /* 多保留一个大页，起点对齐到大页后把两头多出的部分还掉 */
+        char *p = mmap(NULL, MM_RESERVE_SIZE + HUGE_PAGE_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return -1;
+        char *base = (char *) (((unsigned long) p + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (base != p)
+            munmap(p, base - p);
+        munmap(base + MM_RESERVE_SIZE, p + HUGE_PAGE_SIZE - base);
+        madvise(base, MM_RESERVE_SIZE, MADV_HUGEPAGE);
+        reserve.base = base;
+#else
+        void *p = mmap(NULL, MM_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return -1;
+        reserve.base = p;
+#endif
+    } else if (reserve.commit != 0 && reserve_decommit(reserve.base, reserve.commit) != 0) {
+        return -1;
+    }
+    reserve.brk = reserve.commit = reserve.dirty = 0;
+    return 0;
+}
+
+/*
+ * 与mem_sbrk相同，返回原来的堆顶。拓展时提交新用到的页；incr为负时缩小堆，
+ * 新堆顶之后的整页不再提交，不再提交失败时这些页仍然可读写，不影响正确性
+ */
+static void *reserve_sbrk(long incr) {
+    size_t page = TRIM_UNIT;
+    char *old = reserve.base + reserve.brk;
+
+    if (incr < 0) {
+        if ((size_t) -incr > reserve.brk) {
+            errno = EINVAL;
+            return (void *) -1;
+        }
+        reserve.brk += incr;
+        size_t commit = (reserve.brk + page - 1) & ~(page - 1);
+        if (commit < reserve.commit && reserve_decommit(reserve.base + commit, reserve.commit - commit) == 0)
+            reserve.commit = reserve.dirty = commit;
+        return old;
+    }
+    if ((size_t) incr > MM_RESERVE_SIZE - reserve.brk) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    if (reserve.brk + incr > reserve.commit) {
+        size_t commit = (reserve.brk + incr + page - 1) & ~(page - 1);
+        if (mprotect(reserve.base + reserve.commit, commit - reserve.commit, PROT_READ | PROT_WRITE) != 0)
+            return (void *) -1;
+        reserve.commit = commit;
+    }
+    reserve.brk += incr;
+    reserve.dirty = MAX(reserve.dirty, reserve.brk);
+    return old;
+}
+
+/*
+ * 当前arena的chunk在堆顶并且最后一块空闲时，把这一块缩到至少pad字节后的页边界，堆顶随之下降，
+ * 有页被交还时返回1。调用者需已进入arena，不能在遍历空闲结构的过程中调用
+ */
+static int heap_shrink(size_t pad) {
+    HEAP_LOCK();
+    char *end = (char *) mem_heap_hi() + 1;
+    if (cur_arena->chunk_end != end || PREV_ALLOC_R(end - HSIZE)) {
+        HEAP_UNLOCK();
+        return 0;
+    }
+    size_t page = TRIM_UNIT;
+    char *bp = end - SIZE(end - 2 * HSIZE);
+    char *top = (char *) (((unsigned long) bp + MAX(pad, MIN_BLOCK_SIZE) + page - 1) & ~(page - 1));
+    if (top >= end) {
+        HEAP_UNLOCK();
+        return 0;
+    }
+    size_t zero = IS_ZERO_BLOCK(bp);
+    delete_node(bp);
+    PUT_HDRP(bp, PACK(top - bp, PREV_ALLOC(bp)));
+    PUT_FTRP(bp, PACK(top - bp, PREV_ALLOC(bp) | zero));
+    PUT_HDRP(top, PACK(0, STAT_ALLOC));
+    mem_sbrk(-(long) (end - top));
+    footprint_add(-(long) (end - top));
+    cur_arena->chunk_end = top;
+    HEAP_UNLOCK();
+    insert_node(bp);
+    if (cur_arena->compact_at > bp)
+        cur_arena->compact_at = bp;
+    return 1;
+}
+#endif
+
+#ifdef MM_PERSIST
+static void *persist_sbrk(int incr) {
+    if (persist.hdr == 0)
+        return (mem_sbrk)(incr);
+    if (incr < 0 || persist.brk + incr > persist.max_size) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    /* 映射超出文件末尾的部分不能访问，先把文件按ARENA_UNIT加长 */
+    size_t end = PERSIST_HDR_SIZE + persist.brk + incr;
+    if (end > persist.file_size) {
+        size_t size = (end + ARENA_UNIT - 1) & ~(ARENA_UNIT - 1);
+        if (ftruncate(persist.fd, size) != 0)
+            return (void *) -1;
+        persist.file_size = size;
+    }
+    char *old = (char *) persist.hdr + PERSIST_HDR_SIZE + persist.brk;
+    persist.brk += incr;
+    return old;
+}
+
+static void *persist_heap_lo(void) {
+    return persist.hdr != 0 ? (char *) persist.hdr + PERSIST_HDR_SIZE : (mem_heap_lo)();
+}
+
+static void *persist_heap_hi(void) {
+    return persist.hdr != 0 ? (char *) persist.hdr + PERSIST_HDR_SIZE + persist.brk - 1 : (mem_heap_hi)();
+}
+
+static size_t persist_heapsize(void) {
+    return persist.hdr != 0 ? persist.brk : (mem_heapsize)();
+}
+
+/* 把从头部拷回的状态以及slab头中的堆指针移动delta字节，堆块之间的链接是偏移，不需要修正 */
+#define RELOC(p) ((p) = (p) != 0 ? (__typeof__(p)) ((char *) (p) + delta) : (p))
+static void persist_relocate(long delta) {
+    for (int i = 0; i < NARENAS; i++) {
+        arena_t *a = &arenas[i];
+        RELOC(a->root);
+        RELOC(a->small_free_block_list);
+        for (int cls = 0; cls < SLAB_CLASSES; cls++)
+            RELOC(a->partial[cls]);
+        RELOC(a->empty);
+#ifdef MM_TLSF
+        for (int fl = 0; fl < TLSF_FL_COUNT; fl++)
+            for (int sl = 0; sl < TLSF_SL_COUNT; sl++)
+                RELOC(a->free_lists[fl][sl]);
+#endif
+        RELOC(a->chunk_end);
+        RELOC(a->compact_at);
+        RELOC(a->compact_trim);
+    }
+    for (unsigned long page = 0; page < persist.brk >> SLAB_SHIFT; page++) {
+        if (slab_page_map[page >> 3] & (1 << (page & 7))) {
+            slab_t *slab = (slab_t *) (virtual_NULL + (page << SLAB_SHIFT));
+            RELOC(slab->next);
+            RELOC(slab->prev);
+            RELOC(slab->first);
+            RELOC(slab->block);
+        }
+    }
+}
+
+/*
+ * 映射堆文件fd的前len字节，先试want(为0时不试)，不行就映射到任意按ARENA_UNIT对齐的地址
+ * 对齐靠先保留多出ARENA_UNIT的地址空间，再把文件固定映射到其中对齐的位置
  */
-void *extend_heap(size_t words) {
-    void *bp;
-    void *last_block = mem_heap_hi() - 3;
+static void *persist_map(int fd, size_t len, void *want) {
+    char *map;
 
-    size_t size = words;
-    if (!PREV_ALLOC_R(last_block) && size - GET_SIZE(last_block) >= MIN_BLOCK_SIZE) {
-        size -= GET_SIZE(last_block);
+    if (want != 0) {
+        map = mmap(want, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+        if (map == want)
+            return map;
+        /* 老内核不认识MAP_FIXED_NOREPLACE，把它当作提示 */
+        if (map != MAP_FAILED)
+            munmap(map, len);
     }
-    if (size <= 0) return NULL;
-
-    if ((long) (bp = mem_sbrk(size)) == -1)
+    char *area = mmap(NULL, len + ARENA_UNIT, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED)
         return NULL;
-
-    size_t flag = 0 | PREV_ALLOC(bp);
-    PUT_HDRP(bp, PACK(size, flag));
-    PUT_FTRP(bp, PACK(size, flag));
-    PUT_HDRP(NEXT_BLKP(bp), PACK(0, STAT_ALLOC));
-
-    void *temp = coalesce(bp);
-    insert_node(temp);
-    return temp;
+    char *base = (char *) (((unsigned long) area + ARENA_UNIT - 1) & ~(ARENA_UNIT - 1));
+    if (base > area)
+        munmap(area, base - area);
+    munmap(base + len, area + ARENA_UNIT - base);
+    map = mmap(base, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (map == MAP_FAILED) {
+        munmap(base, len);
+        return NULL;
+    }
+    return map;
 }
 
 /*
- * 分配算法，分配的块大小向WSIZE对齐，注意最小块是2*DSIZE的，所以不足时需要补齐
- * 如果没有能从heap中找到合适的块，再对堆扩展
+ * 用文件path作为堆，代替mm_init，必须在第一次分配之前调用
+ * 文件为空时建立最多max_size字节的新堆，否则恢复文件中的堆(max_size取保存时的值)
+ * 返回MM_PERSIST_NEW/RESTORED/MOVED，失败时返回-1并设置errno，
+ * 文件不是同样配置的mm.c保存的，或者上次打开后没有mm_persist_sync就退出了，都视为无效(EINVAL)
  */
+int mm_persist_open(const char *path, size_t max_size) {
+    struct stat st;
+    persist_hdr_t *h;
+    int fd, ret = MM_PERSIST_NEW;
 
-void *malloc(size_t size) {
-    size_t asize;      /* Adjusted block size */
-    char *bp;
-
-    if (heap_listp == 0){
-        mm_init();
+    if (heap_listp != 0 || persist.hdr != 0) {
+        errno = EBUSY;
+        return -1;
     }
-    /* Ignore spurious requests */
-    if (size == 0)
-        return NULL;
-
-    /*  Adjust block size to include overhead and alignment reqs. */
-    //plus WSIZE for we omit the footer of allocated block
-    asize = ALIGN(size + WSIZE);
-    asize = MAX(asize, MIN_BLOCK_SIZE);
-    if ((bp = find_fit(asize)) == (void *) virtual_NULL) {
-        /* No fit found. Get more memory and place the block */
-        extend_heap(asize);
-        if ((bp = find_fit(asize)) == (void *) virtual_NULL)
-            return NULL;
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return -1;
+    if (fstat(fd, &st) != 0)
+        goto fail;
+    void *want = 0;
+    if (st.st_size != 0) {
+        if ((size_t) st.st_size < PERSIST_HDR_SIZE)
+            goto invalid;
+        h = mmap(NULL, sizeof(persist_hdr_t), PROT_READ, MAP_SHARED, fd, 0);
+        if (h == MAP_FAILED)
+            goto fail;
+        int ok = memcmp(h->magic, PERSIST_MAGIC, 8) == 0 && h->config == PERSIST_CONFIG && h->clean
+            && PERSIST_HDR_SIZE + h->brk <= (size_t) st.st_size;
+        max_size = h->max_size;
+        want = (char *) h->lo - PERSIST_HDR_SIZE;
+        munmap(h, sizeof(persist_hdr_t));
+        if (!ok)
+            goto invalid;
     }
-    place(bp, asize);
-    return bp;
-}
+    else {
+        max_size = (MIN(max_size, MAX_HEAP_SIZE) + ARENA_UNIT - 1) & ~(ARENA_UNIT - 1);
+        if (ftruncate(fd, PERSIST_HDR_SIZE) != 0)
+            goto fail;
+        st.st_size = PERSIST_HDR_SIZE;
+    }
+    if ((h = persist_map(fd, PERSIST_HDR_SIZE + max_size, want)) == NULL)
+        goto fail;
 
-/* 释放之前申请的内存空间，合并之后再插入合适的链表中*/
-void free(void *bp) {
-    if (bp == 0)
-        return;
+    persist.fd = fd;
+    persist.hdr = h;
+    persist.max_size = max_size;
+    persist.file_size = st.st_size;
+    if (want == 0) {
+        persist.brk = 0;
+        if (mm_init() < 0) {
+            mm_persist_close();
+            return -1;
+        }
+        memcpy(h->magic, PERSIST_MAGIC, 8);
+        h->config = PERSIST_CONFIG;
+        h->max_size = max_size;
+        h->root = 0;
+    }
+    else {
+        /* 整体拷回保存的状态，只有映射地址变了才需要逐个修正指针 */
+        persist.brk = h->brk;
+        virtual_NULL = (unsigned long) mem_heap_lo();
+        heap_listp = (char *) virtual_NULL + HEAP_PAD;
+        memcpy(arenas, h->arenas, sizeof(arenas));
+        memcpy(chunk_owner, h->chunk_owner, sizeof(chunk_owner));
+        memcpy(slab_page_map, h->slab_page_map, sizeof(slab_page_map));
+        memcpy(short_page_map, h->short_page_map, sizeof(short_page_map));
+        counters = h->counters;
+        counters.next = 0;
+        footprint = h->footprint;
+        peak_footprint = h->peak_footprint;
+        memset(&tcache, 0, sizeof(tcache));
+        slab_tables_init();
+        handle_top = 1;
+        handle_free = 0;
+        if ((char *) h != want) {
+            persist_relocate((long) (virtual_NULL - h->lo));
+            ret = MM_PERSIST_MOVED;
+        }
+        else
+            ret = MM_PERSIST_RESTORED;
+    }
+    mmap_threshold = MAX_HEAP_SIZE;
+    /* 在下一次mm_persist_sync之前崩溃的堆不能再打开 */
+    h->clean = 0;
+    msync(h, mem_pagesize(), MS_SYNC);
+    return ret;
 
-    size_t size = GET_SIZE(bp);
-    size_t checkalloc = GET_ALLOC(bp);
-    if (checkalloc == 0) return;
-    size_t flag = 0 | PREV_ALLOC(bp);
-    PUT_HDRP(bp, PACK(size, flag));
-    PUT_FTRP(bp, PACK(size, flag));
+invalid:
+    errno = EINVAL;
+fail:
+    close(fd);
+    return -1;
+}
 
-    insert_node(coalesce(bp));
+/* sync之后第一次修改堆(或根)时清掉clean并刷回头部，此后崩溃留下的文件不会被当作完整的映像 */
+static void persist_dirty(void) {
+    persist.synced = 0;
+    persist.hdr->clean = 0;
+    msync(persist.hdr, mem_pagesize(), MS_SYNC);
 }
 
 /*
- * 重新分配
- * 如果重新分配的空间比较小，则将原来的块做分割
- * 若不然则重新分配
+ * 把全局状态写进头部并把整个映射刷到文件，成功时返回0，可以随时调用作为检查点
+ * 之后第一次修改堆时头部重新标记为未同步，所以文件要么是最近一次sync时的完整映像，要么打开时被拒绝
  */
-void *realloc(void *ptr, size_t size) {
-    size_t oldsize;
-    void *newptr;
-    /* If size == 0 then this is just free, and we return NULL. */
-    if (size == 0) {
-        free(ptr);
-        return 0;
-    }
-    /* If oldptr is NULL, then this is just malloc. */
-    if (ptr == NULL) {
-        return malloc(size);
+int mm_persist_sync(void) {
+    persist_hdr_t *h = persist.hdr;
+
+    if (h == 0) {
+        errno = EINVAL;
+        return -1;
     }
-    newptr = malloc(size);
-    /* If realloc() fails the original block is left untouched  */
-    if (!newptr) {
-        return 0;
+    /* tcache中的对象在slab中仍标记为已分配，先还回去 */
+    arena_enter();
+    tcache_flush();
+    arena_leave();
+    h->clean = 0;
+    h->max_size = persist.max_size;
+    h->brk = persist.brk;
+    h->lo = virtual_NULL;
+    h->footprint = footprint;
+    h->peak_footprint = peak_footprint;
+    h->counters = counters;
+    memcpy(h->arenas, arenas, sizeof(arenas));
+    memcpy(h->chunk_owner, chunk_owner, sizeof(chunk_owner));
+    memcpy(h->slab_page_map, slab_page_map, sizeof(slab_page_map));
+    memcpy(h->short_page_map, short_page_map, sizeof(short_page_map));
+    if (msync(h, PERSIST_HDR_SIZE + persist.brk, MS_SYNC) != 0)
+        return -1;
+    h->clean = 1;
+    if (msync(h, mem_pagesize(), MS_SYNC) != 0)
+        return -1;
+    persist.synced = 1;
+    return 0;
+}
+
+/* 保存并解除映射，之后可以重新打开这个或另一个堆文件 */
+int mm_persist_close(void) {
+    if (persist.hdr == 0) {
+        errno = EINVAL;
+        return -1;
     }
-    oldsize = GET_SIZE(ptr);
-    if (size < oldsize) oldsize = size;
-    memcpy(newptr, ptr, oldsize);
-    free(ptr);
-    return newptr;
+    int ret = heap_listp != 0 ? mm_persist_sync() : 0;
+    munmap(persist.hdr, PERSIST_HDR_SIZE + persist.max_size);
+    close(persist.fd);
+    persist.hdr = 0;
+    persist.fd = -1;
+    persist.synced = 0;
+    heap_listp = 0;
+    mmap_threshold = MM_MMAP_THRESHOLD;
+    return ret;
+}
+
+/* 用户的根对象按偏移保存在头部，重新打开后由mm_persist_root取回 */
+void mm_persist_set_root(void *p) {
+    if (persist.hdr == 0)
+        return;
+    if (persist.synced)
+        persist_dirty();
+    persist.hdr->root = p != NULL ? (unsigned long) p - virtual_NULL : 0;
+}
+
+void *mm_persist_root(void) {
+    if (persist.hdr == 0 || persist.hdr->root == 0)
+        return NULL;
+    return (char *) virtual_NULL + persist.hdr->root;
 }
+#endif
 
 /*
  * 合并函数，与书中描述的隐式链表模式相近，也是分为四种情况
@@ -259,6 +3232,7 @@ static void *coalesce(void *bp) {
     size_t next_alloc = GET_ALLOC(NEXT_BLKP(bp));
     size_t size = GET_SIZE(bp);
 
+    SLOW_COUNT(SLOW_COALESCE + (!prev_alloc) * 2 + !next_alloc, 1);
     if (prev_alloc && next_alloc) { /* Case 0 */
         return bp;
     }
@@ -268,6 +3242,7 @@ static void *coalesce(void *bp) {
         size_t flag = PREV_ALLOC(bp);
         PUT_HDRP(bp, PACK(size, flag));
         PUT_FTRP(bp, PACK(size, flag));
+        COMPACT_ABSORB(bp);
         return bp;
     }
     else if (!prev_alloc && next_alloc) { /* Case 2*/
@@ -277,6 +3252,7 @@ static void *coalesce(void *bp) {
         size += GET_SIZE(prev);
         PUT_HDRP(prev, PACK(size, flag));
         PUT_FTRP(prev, PACK(size, flag));
+        COMPACT_ABSORB(prev);
         return prev;
     }
     else { /* Case 3 */
@@ -288,6 +3264,7 @@ static void *coalesce(void *bp) {
         size_t flag = PREV_ALLOC(bp);
         PUT_HDRP(prev, PACK(size, flag));
         PUT_FTRP(prev, PACK(size, flag));
+        COMPACT_ABSORB(prev);
         return prev;
     }
 }
@@ -299,6 +3276,7 @@ static void *coalesce(void *bp) {
 static void place(void *bp, size_t asize) {
 
     size_t csize = GET_SIZE(bp);
+    size_t zero = IS_ZERO_BLOCK(bp);//the rest of a zeroed block is still zero
     delete_node(bp);
 
     if ((csize - asize) >= MIN_BLOCK_SIZE) {
@@ -307,7 +3285,7 @@ static void place(void *bp, size_t asize) {
 
         void *temp = NEXT_BLKP(bp);
         PUT_HDRP(temp, PACK(csize - asize, STAT_PREV_ALLOC));
-        PUT_FTRP(temp, PACK(csize - asize, STAT_PREV_ALLOC));
+        PUT_FTRP(temp, PACK(csize - asize, STAT_PREV_ALLOC | zero));
 
         insert_node(coalesce(temp));
     }
@@ -317,19 +3295,22 @@ static void place(void *bp, size_t asize) {
     }
 }
 
+#ifdef MM_BST
 /*
  * 对于给定的size在堆中寻找合适的块，分为两种情况
  * 1.size为最小块大小，则在最小块的空闲链表中查询，取第一个即可，因为大小都是相同的
  * 2.size较大时，在BST中查询
  */
 static void *find_fit(size_t asize) {
-    if (asize <= MIN_BLOCK_SIZE && small_free_block_list != (void *) virtual_NULL) return small_free_block_list;
+    if (asize <= MIN_BLOCK_SIZE && cur_arena->small_free_block_list != (void *) virtual_NULL) return cur_arena->small_free_block_list;
 
     //best-fit policy
     void *bp = (void *) virtual_NULL;
-    void *temp = root;
+    void *temp = cur_arena->root;
+    unsigned long steps = 0;
 
     while (temp != (void *) virtual_NULL) {
+        steps++;
         if (GET_SIZE(temp) >= asize) {
             bp = temp;
             temp = (void *) LCHILD_BLKP(temp);
@@ -337,6 +3318,8 @@ static void *find_fit(size_t asize) {
         else
             temp = (void *) RCHILD_BLKP(temp);
     }
+    SLOW_COUNT(SLOW_TREE_WALKS, 1);
+    SLOW_COUNT(SLOW_TREE_STEPS, steps);
     return bp;
 }
 
@@ -356,40 +3339,114 @@ inline static int judge_child(void * bp) {
     return -1;
 }
 
+/* 在bp原来的父节点中用repl替换bp，bp为根时更新root */
+inline static void replace_child(void *bp, void *repl) {
+    int direction = judge_child(bp);
+    if (direction == 0)
+        cur_arena->root = repl;
+    else if (direction == 1)
+        PUT_LCHILD(PARENT_BLKP(bp), repl);
+    else
+        PUT_RCHILD(PARENT_BLKP(bp), repl);
+    if (repl != (void *) virtual_NULL)
+        PUT_PARENT(repl, PARENT_BLKP(bp));
+}
+
+/* 左旋，bp的右儿子成为bp的父节点 */
+static void rotate_left(void *bp) {
+    void *rchild = (void *) RCHILD_BLKP(bp);
+    PUT_RCHILD(bp, LCHILD_BLKP(rchild));
+    if ((void *) LCHILD_BLKP(rchild) != (void *) virtual_NULL)
+        PUT_PARENT(LCHILD_BLKP(rchild), bp);
+    replace_child(bp, rchild);
+    PUT_LCHILD(rchild, bp);
+    PUT_PARENT(bp, rchild);
+}
+
+/* 右旋，bp的左儿子成为bp的父节点 */
+static void rotate_right(void *bp) {
+    void *lchild = (void *) LCHILD_BLKP(bp);
+    PUT_LCHILD(bp, RCHILD_BLKP(lchild));
+    if ((void *) RCHILD_BLKP(lchild) != (void *) virtual_NULL)
+        PUT_PARENT(RCHILD_BLKP(lchild), bp);
+    replace_child(bp, lchild);
+    PUT_RCHILD(lchild, bp);
+    PUT_PARENT(bp, lchild);
+}
+
+/* 新插入的红节点bp可能与父节点同为红色，沿路径向上重新着色或旋转 */
+static void insert_fixup(void *bp) {
+    while (IS_RED(PARENT_BLKP(bp))) {
+        void *parent = (void *) PARENT_BLKP(bp);
+        void *grand = (void *) PARENT_BLKP(parent);
+        if (parent == (void *) LCHILD_BLKP(grand)) {
+            void *uncle = (void *) RCHILD_BLKP(grand);
+            if (IS_RED(uncle)) {
+                SET_BLACK(parent);
+                SET_BLACK(uncle);
+                SET_RED(grand);
+                bp = grand;
+                continue;
+            }
+            if (bp == (void *) RCHILD_BLKP(parent)) {
+                bp = parent;
+                rotate_left(bp);
+                parent = (void *) PARENT_BLKP(bp);
+            }
+            SET_BLACK(parent);
+            SET_RED(grand);
+            rotate_right(grand);
+        }
+        else {
+            void *uncle = (void *) LCHILD_BLKP(grand);
+            if (IS_RED(uncle)) {
+                SET_BLACK(parent);
+                SET_BLACK(uncle);
+                SET_RED(grand);
+                bp = grand;
+                continue;
+            }
+            if (bp == (void *) LCHILD_BLKP(parent)) {
+                bp = parent;
+                rotate_right(bp);
+                parent = (void *) PARENT_BLKP(bp);
+            }
+            SET_BLACK(parent);
+            SET_RED(grand);
+            rotate_left(grand);
+        }
+    }
+    SET_BLACK(cur_arena->root);
+}
 
 /* 向合适的链表中插入一个新的空闲块，分为两种情况
  * 1.size较小，直接插入双向链表的开头
  * 2.size较大，则需要插入BST，先查找这个节点
  * 如果找到了，那么需要将节点插入找到的这个节点对应的空闲链表的开头
- * 如果没有找到，则创建一个新的节点
+ * 如果没有找到，则创建一个新的红色节点，再调用insert_fixup恢复红黑树性质
  */
 inline static void insert_node( void *bp ) {
 
     CLEAR_PREV_ALLOC(NEXT_BLKP(bp)); //reset the second bit of the HDRPer of the next block
+    cur_arena->free_bytes += GET_SIZE(bp);
+    cur_arena->free_blocks++;
+    cur_arena->largest_free = MAX(cur_arena->largest_free, GET_SIZE(bp));
 
     if (GET_SIZE(bp) == MIN_BLOCK_SIZE) {
-        if (small_free_block_list == (void *) virtual_NULL) {
-            PUT_S_SUCC(bp, small_free_block_list);
+        if (cur_arena->small_free_block_list == (void *) virtual_NULL) {
+            PUT_S_SUCC(bp, cur_arena->small_free_block_list);
             PUT_S_PRED(bp, (void *) virtual_NULL);
-            small_free_block_list = bp;
+            cur_arena->small_free_block_list = bp;
             return;
         }
-        PUT_S_SUCC(bp, small_free_block_list);
-        PUT_S_PRED(small_free_block_list, bp);
+        PUT_S_SUCC(bp, cur_arena->small_free_block_list);
+        PUT_S_PRED(cur_arena->small_free_block_list, bp);
         PUT_S_PRED(bp, (void *) virtual_NULL);
-        small_free_block_list = bp;
+        cur_arena->small_free_block_list = bp;
         return;
     }
-    if (root == (void *) virtual_NULL) {
-        PUT_LCHILD(bp, (void *) virtual_NULL);
-        PUT_RCHILD(bp, (void *) virtual_NULL);
-        PUT_PARENT(bp, (void *) virtual_NULL);
-        PUT_HANGER(bp, (void *) virtual_NULL);
-        root = bp;   //root is also an address.
-        return;
-    }
-    void *parent = root;
-    void *temp = root;
+    void *parent = (void *) virtual_NULL;
+    void *temp = cur_arena->root;
     int flag = 0;
     /*flag = 0 : the root itself; flag = 1 : left; flag = 2 : right*/
     while (temp != (void *) virtual_NULL) {
@@ -410,11 +3467,14 @@ inline static void insert_node( void *bp ) {
                 else if (direction == 2)
                     PUT_RCHILD(PARENT_BLKP(temp), bp);
             }
+            if (IS_RED(temp)) SET_RED(bp);
+            else SET_BLACK(bp);
             PUT_HANGER(bp, temp);
             PUT_PARENT(temp, bp);
+            cur_arena->hanger_nodes++;
             PUT_LCHILD(temp, (void *) virtual_NULL);
             PUT_RCHILD(temp, (void *) virtual_NULL);
-            if (root == temp) root = bp;
+            if (cur_arena->root == temp) cur_arena->root = bp;
             return;
             /*SEARCH RIGHT CHILD*/
         } else if (GET_SIZE(temp) < GET_SIZE(bp)) {
@@ -429,7 +3489,9 @@ inline static void insert_node( void *bp ) {
         }
     }
     /*insert new node*/
-    if (flag == 1) {
+    if (flag == 0) {
+        cur_arena->root = bp;   //root is also an address.
+    } else if (flag == 1) {
         PUT_LCHILD(parent, bp);
     } else {
         PUT_RCHILD(parent, bp);
@@ -438,6 +3500,9 @@ inline static void insert_node( void *bp ) {
     PUT_RCHILD(bp, (void *) virtual_NULL);
     PUT_PARENT(bp, parent);
     PUT_HANGER(bp, (void *) virtual_NULL);
+    SET_RED(bp);
+    cur_arena->bst_nodes++;
+    insert_fixup(bp);
 }
 
 
@@ -445,33 +3510,39 @@ inline static void insert_node( void *bp ) {
  * 1.size小时，直接删除双向链表的第一个元素
  * 2.size较大，则调用函数来进行BST的节点删除*/
 inline static void delete_node(void *bp) {
+    size_t size = GET_SIZE(bp);
     SET_PREV_ALLOC(NEXT_BLKP(bp));
+    cur_arena->free_bytes -= size;
+    cur_arena->free_blocks--;
 
-    if (GET_SIZE(bp) == MIN_BLOCK_SIZE) {
-        if (bp == small_free_block_list) {
-            small_free_block_list = (void *) S_SUCC_BLKP(bp);
-            PUT_S_PRED(small_free_block_list, (void *) virtual_NULL);
-            return;
-        }
-
-        void *bpleft = (void *) S_PRED_BLKP(bp);
-        void *bpright = (void *) S_SUCC_BLKP(bp);
-
-        PUT_S_SUCC(LCHILD_BLKP(bp), bpright);
-        PUT_S_PRED(RCHILD_BLKP(bp), bpleft);
+    if (size == MIN_BLOCK_SIZE) {
+        if (bp == cur_arena->small_free_block_list) {
+            cur_arena->small_free_block_list = (void *) S_SUCC_BLKP(bp);
+            if (cur_arena->small_free_block_list != (void *) virtual_NULL)
+                PUT_S_PRED(cur_arena->small_free_block_list, (void *) virtual_NULL);
+        } else {
+            void *bpleft = (void *) S_PRED_BLKP(bp);
+            void *bpright = (void *) S_SUCC_BLKP(bp);
 
-        return;
+            PUT_S_SUCC(bpleft, bpright);
+            if (bpright != (void *) virtual_NULL)
+                PUT_S_PRED(bpright, bpleft);
+        }
+    } else {
+        delete(bp);
     }
-    delete(bp);
+    /* 删掉的是最大的块时沿最右的路径找新的最大块，mm_stats直接读取 */
+    if (size == cur_arena->largest_free)
+        cur_arena->largest_free = largest_free_block();
 }
 
 /*在BST中的删除分为三种情况
- * 1.节点有悬挂节点，则用悬挂节点替代该节点
+ * 1.节点有悬挂节点，则用悬挂节点替代该节点，颜色也一并继承，树的形状不变
  * 2.节点无悬挂节点，但是是某一个节点的悬挂节点，则直接删掉
- * 3.节点是BST中的节点，则调用BST中删除节点的函数*/
+ * 3.节点是BST中的节点，则调用红黑树中删除节点的函数*/
 inline static void delete(void *bp) {
 
-    if (root == (void *) virtual_NULL) {
+    if (cur_arena->root == (void *) virtual_NULL) {
         return ;
     }
 
@@ -500,88 +3571,510 @@ inline static void delete(void *bp) {
             else PUT_HANGER(parent, (void *) HANGER_BLKP(bp));
 
         }
-        if (root == bp) root = temp;
+        if (IS_RED(bp)) SET_RED(temp);
+        else SET_BLACK(temp);
+        if (cur_arena->root == bp) cur_arena->root = temp;
+        cur_arena->hanger_nodes--;
         return ;
     }
 
     if ((void *)PARENT_BLKP(bp) != (void *)virtual_NULL && (void *) HANGER_BLKP(PARENT_BLKP(bp)) == bp) {
         PUT_HANGER((void *)PARENT_BLKP(bp), virtual_NULL);
+        cur_arena->hanger_nodes--;
         return ;
     }
 
-    delete_first_node(bp, judge_child(bp));
+    cur_arena->bst_nodes--;
+    delete_first_node(bp);
+}
+
+/* 删除后child所在的子树少了一个黑节点，parent为其父节点(child可能为virtual_NULL)
+ * 通过重新着色和旋转把缺少的黑节点补回来 */
+static void delete_fixup(void *child, void *parent) {
+    while (child != cur_arena->root && !IS_RED(child)) {
+        if (child == (void *) LCHILD_BLKP(parent)) {
+            void *sibling = (void *) RCHILD_BLKP(parent);
+            if (IS_RED(sibling)) {
+                SET_BLACK(sibling);
+                SET_RED(parent);
+                rotate_left(parent);
+                sibling = (void *) RCHILD_BLKP(parent);
+            }
+            if (!IS_RED(LCHILD_BLKP(sibling)) && !IS_RED(RCHILD_BLKP(sibling))) {
+                SET_RED(sibling);
+                child = parent;
+                parent = (void *) PARENT_BLKP(child);
+                continue;
+            }
+            if (!IS_RED(RCHILD_BLKP(sibling))) {
+                SET_BLACK(LCHILD_BLKP(sibling));
+                SET_RED(sibling);
+                rotate_right(sibling);
+                sibling = (void *) RCHILD_BLKP(parent);
+            }
+            if (IS_RED(parent)) SET_RED(sibling);
+            else SET_BLACK(sibling);
+            SET_BLACK(parent);
+            SET_BLACK(RCHILD_BLKP(sibling));
+            rotate_left(parent);
+        }
+        else {
+            void *sibling = (void *) LCHILD_BLKP(parent);
+            if (IS_RED(sibling)) {
+                SET_BLACK(sibling);
+                SET_RED(parent);
+                rotate_right(parent);
+                sibling = (void *) LCHILD_BLKP(parent);
+            }
+            if (!IS_RED(LCHILD_BLKP(sibling)) && !IS_RED(RCHILD_BLKP(sibling))) {
+                SET_RED(sibling);
+                child = parent;
+                parent = (void *) PARENT_BLKP(child);
+                continue;
+            }
+            if (!IS_RED(LCHILD_BLKP(sibling))) {
+                SET_BLACK(RCHILD_BLKP(sibling));
+                SET_RED(sibling);
+                rotate_left(sibling);
+                sibling = (void *) LCHILD_BLKP(parent);
+            }
+            if (IS_RED(parent)) SET_RED(sibling);
+            else SET_BLACK(sibling);
+            SET_BLACK(parent);
+            SET_BLACK(LCHILD_BLKP(sibling));
+            rotate_right(parent);
+        }
+        child = cur_arena->root;
+    }
+    if (child != (void *) virtual_NULL)
+        SET_BLACK(child);
 }
 
-/* 删除BST节点，只需将其替换为左子树的最大节点 */
-inline static void delete_first_node(void * bp, int direction) {
+/* 删除BST节点，将其替换为左子树的最大节点，替换节点继承被删节点的颜色
+ * 若真正摘下的节点是黑色的，则调用delete_fixup */
+inline static void delete_first_node(void * bp) {
 
-    void *replpointer, *replparent = (void *) virtual_NULL, *delparent = (void *) PARENT_BLKP(bp);
+    void *replpointer, *child, *parent;
+    int removed_red;
 
     //带删除节点左子树为空，则直接用右子树代替
-    if ((void *) LCHILD_BLKP(bp) == (void *) virtual_NULL)
-        replpointer = (void *) RCHILD_BLKP(bp);
-    //若不为空，在在左子树中寻找最大节点
+    if ((void *) LCHILD_BLKP(bp) == (void *) virtual_NULL) {
+        child = (void *) RCHILD_BLKP(bp);
+        parent = (void *) PARENT_BLKP(bp);
+        removed_red = IS_RED(bp);
+        replace_child(bp, child);
+    }
+    else if ((void *) RCHILD_BLKP(bp) == (void *) virtual_NULL) {
+        child = (void *) LCHILD_BLKP(bp);
+        parent = (void *) PARENT_BLKP(bp);
+        removed_red = IS_RED(bp);
+        replace_child(bp, child);
+    }
+    //若都不为空，在在左子树中寻找最大节点
     else {
         replpointer = (void *) LCHILD_BLKP(bp);
-        while ((void *) RCHILD_BLKP(replpointer) != (void *) virtual_NULL) {
-            replparent = replpointer;
+        while ((void *) RCHILD_BLKP(replpointer) != (void *) virtual_NULL)
             replpointer = (void *) RCHILD_BLKP(replpointer);
-        }
+        removed_red = IS_RED(replpointer);
+        child = (void *) LCHILD_BLKP(replpointer);
         //替换节点就是被删节点左子节点
-        if (replparent == (void *) virtual_NULL) {
-            PUT_LCHILD(bp, LCHILD_BLKP(replpointer));
-            if ((void *) LCHILD_BLKP(replpointer) != (void *) virtual_NULL)
-                PUT_PARENT(LCHILD_BLKP(replpointer), bp);
+        if ((void *) PARENT_BLKP(replpointer) == bp) {
+            parent = replpointer;
         } else {
-            PUT_RCHILD(replparent, LCHILD_BLKP(replpointer));
-            if ((void *) LCHILD_BLKP(replpointer) != (void *) virtual_NULL)
-                PUT_PARENT(LCHILD_BLKP(replpointer), replparent);
-        }
-        PUT_LCHILD(replpointer, LCHILD_BLKP(bp));
-        if ((void *) LCHILD_BLKP(bp) != (void *) virtual_NULL)
+            parent = (void *) PARENT_BLKP(replpointer);
+            replace_child(replpointer, child);
+            PUT_LCHILD(replpointer, LCHILD_BLKP(bp));
             PUT_PARENT(LCHILD_BLKP(bp), replpointer);
+        }
+        replace_child(bp, replpointer);
         PUT_RCHILD(replpointer, RCHILD_BLKP(bp));
-        if ((void *) RCHILD_BLKP(bp) != (void *) virtual_NULL)
-            PUT_PARENT(RCHILD_BLKP(bp), replpointer);
+        PUT_PARENT(RCHILD_BLKP(bp), replpointer);
+        if (IS_RED(bp)) SET_RED(replpointer);
+        else SET_BLACK(replpointer);
     }
 
-    if (delparent == (void *) virtual_NULL)
-        root = replpointer;
-    else if ((void *) LCHILD_BLKP(delparent) == bp)
-        PUT_LCHILD(delparent, replpointer);
-    else
-        PUT_RCHILD(delparent, replpointer);
-    PUT_PARENT(replpointer, delparent);
+    if (!removed_red)
+        delete_fixup(child, parent);
+}
+
+/* 遍历以bp为根的子树，连同悬挂链表中的块一起归还整页 */
+static int trim_tree(void *bp, size_t pad) {
+    int released = 0;
+    if (bp == (void *) virtual_NULL)
+        return 0;
+    for (void *temp = bp; temp != (void *) virtual_NULL; temp = (void *) HANGER_BLKP(temp))
+        released |= trim_block(temp, pad);
+    released |= trim_tree((void *) LCHILD_BLKP(bp), pad);
+    released |= trim_tree((void *) RCHILD_BLKP(bp), pad);
+    return released;
+}
+
+/* BST中最右的节点，BST为空时看小块链表 */
+static size_t largest_free_block(void) {
+    void *bp = cur_arena->root;
+    if (bp == (void *) virtual_NULL)
+        return cur_arena->small_free_block_list != (void *) virtual_NULL ? MIN_BLOCK_SIZE : 0;
+    while ((void *) RCHILD_BLKP(bp) != (void *) virtual_NULL)
+        bp = (void *) RCHILD_BLKP(bp);
+    return GET_SIZE(bp);
+}
+
+/* 小块链表中的块不足一页，只需遍历BST */
+static int trim_free_blocks(size_t pad) {
+    return trim_tree(cur_arena->root, pad);
+}
+#elif defined(MM_TLSF)
+/* 由块大小计算所在的两级索引 */
+static inline void tlsf_mapping(size_t size, int *fl, int *sl) {
+    if (size < TLSF_SMALL) {
+        *fl = 0;
+        *sl = size / DSIZE;
+    } else {
+        int msb = 63 - __builtin_clzl(size);
+        *fl = msb - TLSF_FL_OFFSET;
+        *sl = (size >> (msb - TLSF_SL_SHIFT)) & (TLSF_SL_COUNT - 1);
+    }
+}
+
+/*
+ * 先把asize向上取整到下一个划分的起点，这样找到的链表中任何一块都足够大(good-fit)
+ * 在同一级中找不小于sl的非空链表，没有则在更高的级中找最小的非空链表
+ */
+static void *find_fit(size_t asize) {
+    int fl, sl;
+    if (asize >= TLSF_SMALL)
+        asize += (1UL << (63 - __builtin_clzl(asize) - TLSF_SL_SHIFT)) - 1;
+    tlsf_mapping(asize, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+        return (void *) virtual_NULL;
+
+    unsigned int sl_map = cur_arena->sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        unsigned int fl_map = cur_arena->fl_bitmap & (~0U << (fl + 1));
+        if (fl_map == 0)
+            return (void *) virtual_NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = cur_arena->sl_bitmap[fl];
+    }
+    return cur_arena->free_lists[fl][__builtin_ctz(sl_map)];
+}
+
+/* 插入到对应链表的开头，并置位两级位图 */
+inline static void insert_node(void *bp) {
+    int fl, sl;
+
+    CLEAR_PREV_ALLOC(NEXT_BLKP(bp)); //reset the second bit of the HDRPer of the next block
+
+    cur_arena->free_bytes += GET_SIZE(bp);
+    cur_arena->free_blocks++;
+    cur_arena->largest_free = MAX(cur_arena->largest_free, GET_SIZE(bp));
+    tlsf_mapping(GET_SIZE(bp), &fl, &sl);
+    void *head = cur_arena->free_lists[fl][sl];
+    PUT_S_PRED(bp, (void *) virtual_NULL);
+    PUT_S_SUCC(bp, head);
+    if (head != (void *) virtual_NULL)
+        PUT_S_PRED(head, bp);
+    cur_arena->free_lists[fl][sl] = bp;
+    cur_arena->fl_bitmap |= 1U << fl;
+    cur_arena->sl_bitmap[fl] |= 1U << sl;
+}
+
+/* 从双向链表中删除，链表变空时清除位图 */
+inline static void delete_node(void *bp) {
+    int fl, sl;
+
+    SET_PREV_ALLOC(NEXT_BLKP(bp));
+    cur_arena->free_bytes -= GET_SIZE(bp);
+    cur_arena->free_blocks--;
+
+    tlsf_mapping(GET_SIZE(bp), &fl, &sl);
+    void *bpleft = (void *) S_PRED_BLKP(bp);
+    void *bpright = (void *) S_SUCC_BLKP(bp);
+    if (bpleft != (void *) virtual_NULL) {
+        PUT_S_SUCC(bpleft, bpright);
+    } else {
+        cur_arena->free_lists[fl][sl] = bpright;
+        if (bpright == (void *) virtual_NULL) {
+            cur_arena->sl_bitmap[fl] &= ~(1U << sl);
+            if (cur_arena->sl_bitmap[fl] == 0)
+                cur_arena->fl_bitmap &= ~(1U << fl);
+        }
+    }
+    if (bpright != (void *) virtual_NULL)
+        PUT_S_PRED(bpright, bpleft);
+    /* 删掉的是最大的块时找新的最大块要遍历一个链表，这里只做标记，由mm_stats去找 */
+    if (GET_SIZE(bp) == cur_arena->largest_free)
+        cur_arena->largest_stale = 1;
+}
+
+/* 最高的非空链表中的块大小只在一个划分内，遍历这一个链表 */
+static size_t largest_free_block(void) {
+    size_t largest = 0;
+    if (cur_arena->fl_bitmap == 0)
+        return 0;
+    int fl = 31 - __builtin_clz(cur_arena->fl_bitmap);
+    int sl = 31 - __builtin_clz(cur_arena->sl_bitmap[fl]);
+    for (void *bp = cur_arena->free_lists[fl][sl]; bp != (void *) virtual_NULL; bp = (void *) S_SUCC_BLKP(bp))
+        largest = MAX(largest, GET_SIZE(bp));
+    return largest;
+}
+
+/* 只有不小于一页的块可能含有整页，从对应的一级开始遍历各个链表 */
+static int trim_free_blocks(size_t pad) {
+    int released = 0, fl, sl;
+    tlsf_mapping(TRIM_UNIT, &fl, &sl);
+    for (; fl < TLSF_FL_COUNT; fl++)
+        for (sl = 0; sl < TLSF_SL_COUNT; sl++)
+            for (void *bp = cur_arena->free_lists[fl][sl]; bp != (void *) virtual_NULL; bp = (void *) S_SUCC_BLKP(bp))
+                released |= trim_block(bp, pad);
+    return released;
+}
+#else
+/* 取一个空闲的叶子，没有时一次映射BT_LEAF_BATCH个 */
+static bt_leaf_t *bt_new_leaf(void) {
+    bt_leaf_t *l = cur_arena->bt_spare;
+    if (l == NULL) {
+        l = mmap(NULL, BT_LEAF_BATCH * sizeof(bt_leaf_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (l == MAP_FAILED)
+            return NULL;
+        for (int i = 1; i < BT_LEAF_BATCH - 1; i++)
+            l[i].keys[0] = (unsigned long) &l[i + 1];
+        l[BT_LEAF_BATCH - 1].keys[0] = 0;
+        cur_arena->bt_spare = &l[1];
+    } else {
+        cur_arena->bt_spare = (bt_leaf_t *) l->keys[0];
+    }
+    l->n = 0;
+    return l;
+}
+
+static void bt_free_leaf(bt_leaf_t *l) {
+    l->keys[0] = (unsigned long) cur_arena->bt_spare;
+    cur_arena->bt_spare = l;
+}
+
+/* 在第i个叶子之前插入叶子l，下界为bound，数组满时加倍 */
+static int bt_insert_leaf(size_t i, bt_leaf_t *l, unsigned long bound) {
+    arena_t *a = cur_arena;
+    if (a->bt_nleaves == a->bt_cap) {
+        size_t cap = a->bt_cap ? a->bt_cap * 2 : 512;
+        void *mem = mmap(NULL, cap * (sizeof(unsigned long) + sizeof(bt_leaf_t *)), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return 0;
+        unsigned long *bounds = mem;
+        bt_leaf_t **leaves = (bt_leaf_t **) (bounds + cap);
+        if (a->bt_cap != 0) {
+            memcpy(bounds, a->bt_bounds, a->bt_nleaves * sizeof(unsigned long));
+            memcpy(leaves, a->bt_leaves, a->bt_nleaves * sizeof(bt_leaf_t *));
+            munmap(a->bt_bounds, a->bt_cap * (sizeof(unsigned long) + sizeof(bt_leaf_t *)));
+        }
+        a->bt_bounds = bounds;
+        a->bt_leaves = leaves;
+        a->bt_cap = cap;
+    }
+    memmove(a->bt_bounds + i + 1, a->bt_bounds + i, (a->bt_nleaves - i) * sizeof(unsigned long));
+    memmove(a->bt_leaves + i + 1, a->bt_leaves + i, (a->bt_nleaves - i) * sizeof(bt_leaf_t *));
+    a->bt_bounds[i] = bound;
+    a->bt_leaves[i] = l;
+    a->bt_nleaves++;
+    return 1;
+}
+
+static void bt_remove_leaf(size_t i) {
+    arena_t *a = cur_arena;
+    bt_free_leaf(a->bt_leaves[i]);
+    a->bt_nleaves--;
+    memmove(a->bt_bounds + i, a->bt_bounds + i + 1, (a->bt_nleaves - i) * sizeof(unsigned long));
+    memmove(a->bt_leaves + i, a->bt_leaves + i + 1, (a->bt_nleaves - i) * sizeof(bt_leaf_t *));
+}
+
+/* 可能含有key的叶子：下界不大于key的最后一个叶子，key比所有下界都小时为第0个 */
+static size_t bt_leaf_of(unsigned long key) {
+    size_t lo = 0, hi = cur_arena->bt_nleaves;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (cur_arena->bt_bounds[mid] <= key)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* 叶子中第一个不小于key的位置 */
+static int bt_lower(bt_leaf_t *l, unsigned long key) {
+    int lo = 0, hi = l->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (l->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* 键不小于size对应的最小键的第一个块，也就是地址最低的最佳适配块 */
+static void *find_fit(size_t asize) {
+    unsigned long key = BT_KEY(asize + ALIGNMENT - 1, virtual_NULL);
+    if (cur_arena->bt_nleaves == 0)
+        return (void *) virtual_NULL;
+    SLOW_COUNT(SLOW_TREE_WALKS, 1);
+    size_t i = bt_leaf_of(key);
+    bt_leaf_t *l = cur_arena->bt_leaves[i];
+    int j = bt_lower(l, key);
+    if (j == (int) l->n) {
+        if (++i == cur_arena->bt_nleaves)
+            return (void *) virtual_NULL;
+        l = cur_arena->bt_leaves[i];
+        j = 0;
+    }
+    return (void *) BT_KEY_BLKP(l->keys[j]);
+}
+
+/*
+ * 插入bp的键，叶子满时对半分裂。键比第0个叶子的下界还小时降低这个下界，
+ * 其它叶子的下界只在分裂时设置，删除时不变，仍然是有效的下界
+ * 计数器只在键插入后更新。索引的空间申请失败时块不进入索引也不计入空闲字节，
+ * 相邻的块释放时照常与它合并，合并后的块重新插入；mm_checkheap会报告这样的块
+ */
+inline static void insert_node(void *bp) {
+    arena_t *a = cur_arena;
+    unsigned long key = BT_KEY(GET_SIZE(bp), bp);
+
+    CLEAR_PREV_ALLOC(NEXT_BLKP(bp)); //reset the second bit of the HDRPer of the next block
+    if (a->bt_nleaves == 0) {
+        bt_leaf_t *l = bt_new_leaf();
+        if (l == NULL || !bt_insert_leaf(0, l, key))
+            return;
+    }
+    size_t i = bt_leaf_of(key);
+    bt_leaf_t *l = a->bt_leaves[i];
+    int j = bt_lower(l, key);
+    if (l->n == BT_LEAF_KEYS) {
+        bt_leaf_t *r = bt_new_leaf();
+        int half = BT_LEAF_KEYS / 2;
+        if (r == NULL)
+            return;
+        r->n = BT_LEAF_KEYS - half;
+        memcpy(r->keys, l->keys + half, r->n * sizeof(unsigned long));
+        if (!bt_insert_leaf(i + 1, r, r->keys[0])) {
+            bt_free_leaf(r);
+            return;
+        }
+        l->n = half;
+        if (j > half) {
+            l = r;
+            j -= half;
+        }
+    }
+    memmove(l->keys + j + 1, l->keys + j, (l->n - j) * sizeof(unsigned long));
+    l->keys[j] = key;
+    l->n++;
+    if (key < a->bt_bounds[i])
+        a->bt_bounds[i] = key;
+    a->free_bytes += GET_SIZE(bp);
+    a->free_blocks++;
+    a->largest_free = MAX(a->largest_free, GET_SIZE(bp));
+}
+
+/*
+ * 删除bp的键，叶子变空时删除叶子，与后一个叶子加起来不到一半时合并
+ * 没能进入索引的块没有计入计数器，找不到键时只恢复下一块的PREV_ALLOC
+ */
+inline static void delete_node(void *bp) {
+    arena_t *a = cur_arena;
+    unsigned long key = BT_KEY(GET_SIZE(bp), bp);
+
+    SET_PREV_ALLOC(NEXT_BLKP(bp));
+    if (a->bt_nleaves == 0)
+        return;
+    size_t i = bt_leaf_of(key);
+    bt_leaf_t *l = a->bt_leaves[i];
+    int j = bt_lower(l, key);
+    if (j == (int) l->n || l->keys[j] != key)
+        return;
+    a->free_bytes -= GET_SIZE(bp);
+    a->free_blocks--;
+    l->n--;
+    memmove(l->keys + j, l->keys + j + 1, (l->n - j) * sizeof(unsigned long));
+    if (l->n == 0) {
+        bt_remove_leaf(i);
+    } else if (i + 1 < a->bt_nleaves && l->n + a->bt_leaves[i + 1]->n <= BT_LEAF_KEYS / 2) {
+        bt_leaf_t *r = a->bt_leaves[i + 1];
+        memcpy(l->keys + l->n, r->keys, r->n * sizeof(unsigned long));
+        l->n += r->n;
+        bt_remove_leaf(i + 1);
+    }
+    /* 最大的键在最后一个叶子的末尾 */
+    if (GET_SIZE(bp) == a->largest_free)
+        a->largest_free = largest_free_block();
+}
+
+/* 最后一个叶子的最后一个键 */
+static size_t largest_free_block(void) {
+    if (cur_arena->bt_nleaves == 0)
+        return 0;
+    bt_leaf_t *l = cur_arena->bt_leaves[cur_arena->bt_nleaves - 1];
+    return BT_KEY_SIZE(l->keys[l->n - 1]);
+}
+
+/* 从不小于一页的第一个键开始按顺序遍历 */
+static int trim_free_blocks(size_t pad) {
+    int released = 0;
+    unsigned long key = BT_KEY(TRIM_UNIT, virtual_NULL);
+    if (cur_arena->bt_nleaves == 0)
+        return 0;
+    for (size_t i = bt_leaf_of(key); i < cur_arena->bt_nleaves; i++) {
+        bt_leaf_t *l = cur_arena->bt_leaves[i];
+        for (int j = bt_lower(l, key); j < (int) l->n; j++)
+            released |= trim_block((void *) BT_KEY_BLKP(l->keys[j]), pad);
+    }
+    return released;
 }
+#endif
 /*
  * lineno = 0时打印小内存块空闲链表中的所有块，并排错
- * lineno = 1时打印BST中所有块，并排错
+ * lineno = 1时打印BST(MM_TLSF时为TLSF的各个链表，MM_BTREE时为索引)中所有块，并排错
  */
 void mm_checkheap(int lineno)
 {
+#ifdef MM_THREADS
+    if (cur_arena == 0) return;
+#endif
     if (lineno == 0) {
         small_free_block_list_checker();
         return ;
     }
     if (lineno == 1) {
-        BST_checker(root);
+#ifdef MM_BST
+        BST_checker(cur_arena->root);
+#elif defined(MM_TLSF)
+        tlsf_checker();
+#else
+        bt_checker();
+#endif
         return ;
     }
 }
 
-/*打印块的信息，将所有指针信息打印出，由于两种块的组织不同，所以分情况打印*/
+/*打印块的信息，将所有指针信息打印出，各个引擎中块的组织不同，所以分情况打印
+ * BST中小块在链表里，其余块在树上；TLSF中的块都在链表里；B树的块中没有指针，只打印键*/
 static inline void printBlock(void *bp) {
 
     size_t alloc_flag = GET_ALLOC(bp);
     if (!alloc_flag) {
         if (SIZE(HDRP(bp)) != SIZE(FTRP(bp)) || ALLOC(HDRP(bp)) != ALLOC(FTRP(bp))) {
             printf("Header and footer inconsistency!\n");
-            printf("block_ptr = %p, header = %u, footer = %u\n",
-                   bp, *(unsigned int*) HDRP(bp), *(unsigned int*) FTRP(bp));
+            printf("block_ptr = %p, header = %lu, footer = %lu\n",
+                   bp, (unsigned long) GET(HDRP(bp)), (unsigned long) GET(FTRP(bp)));
             exit(0);
         }
     }
     size_t blocksize = GET_SIZE(bp);
+#ifdef MM_BST
     if (blocksize <= MIN_BLOCK_SIZE) {
         printf("Ptr_addr = %p, PRED = %p, SUCC = %p\n",
                bp, (void *) S_PRED_BLKP(bp), (void *) S_SUCC_BLKP(bp));
@@ -591,6 +4084,12 @@ static inline void printBlock(void *bp) {
                bp, (void *) LCHILD_BLKP(bp), (void *) RCHILD_BLKP(bp), (void *) PARENT_BLKP(bp),
                (void *) HANGER_BLKP(bp));
     }
+#elif defined(MM_TLSF)
+    printf("Ptr_addr = %p, size = %zu, PRED = %p, SUCC = %p\n",
+           bp, blocksize, (void *) S_PRED_BLKP(bp), (void *) S_SUCC_BLKP(bp));
+#else
+    printf("Ptr_addr = %p, size = %zu, key = %lx\n", bp, blocksize, BT_KEY(blocksize, bp));
+#endif
 
 }
 
@@ -598,12 +4097,12 @@ static inline void printBlock(void *bp) {
  * 如果header footer不对应则报错
  * */
 static inline void small_free_block_list_checker() {
-    void *temp = small_free_block_list;
+    void *temp = cur_arena->small_free_block_list;
     while (temp != (void *)virtual_NULL) {
-        if (((*(unsigned int *) HDRP(temp)) & ~0x7) != ((*(unsigned int *) FTRP(temp)) & ~0x7)) {
+        if ((GET(HDRP(temp)) & ~0x7) != (GET(FTRP(temp)) & ~0x7)) {
             printf("Header and footer inconsistency!\n");
-            printf("block_ptr = %p, header = %x, footer = %x\n",
-                   temp, *(unsigned int*) HDRP(temp), *(unsigned int*) FTRP(temp));
+            printf("block_ptr = %p, header = %lx, footer = %lx\n",
+                   temp, (unsigned long) GET(HDRP(temp)), (unsigned long) GET(FTRP(temp)));
             exit(0);
         }
         printf("Block:\n:");
@@ -620,11 +4119,18 @@ static inline void small_free_block_list_checker() {
     }
 }
 
+#ifdef MM_BST
 /*遍历BST树，先序遍历逐次打印
  * 如果后继指针与前驱指针不对应则报错
- * 如果header footer不对应则报错*/
+ * 如果header footer不对应则报错
+ * 如果红节点有红色的儿子则报错*/
 static inline void BST_checker(void *bp) {
     if (bp == (void *) virtual_NULL) return;
+    if (IS_RED(bp) && (IS_RED(LCHILD_BLKP(bp)) || IS_RED(RCHILD_BLKP(bp)))) {
+        printf("Red node with red child!\n");
+        printf("block_ptr = %p\n", bp);
+        exit(0);
+    }
     void *temp = bp;
     printf("BST node and its hangers:\n");
     while (HANGER_BLKP(temp) != virtual_NULL) {
@@ -635,4 +4141,91 @@ static inline void BST_checker(void *bp) {
     BST_checker((void *) LCHILD_BLKP(bp));
     BST_checker((void *) RCHILD_BLKP(bp));
 }
-
+#elif defined(MM_TLSF)
+/*遍历TLSF的每个链表，如果块大小与所在链表不对应则报错
+ * 如果后继指针与前驱指针不对应则报错
+ * 如果链表是否为空与位图不对应则报错*/
+static inline void tlsf_checker(void) {
+    for (int fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        for (int sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            void *temp = cur_arena->free_lists[fl][sl];
+            int bit = (cur_arena->sl_bitmap[fl] >> sl) & 1;
+            if (bit != (temp != (void *) virtual_NULL) || (bit && !((cur_arena->fl_bitmap >> fl) & 1))) {
+                printf("Bitmap and free list inconsistency!\n");
+                printf("fl = %d, sl = %d, head = %p\n", fl, sl, temp);
+                exit(0);
+            }
+            while (temp != (void *) virtual_NULL) {
+                int tfl, tsl;
+                tlsf_mapping(GET_SIZE(temp), &tfl, &tsl);
+                if (tfl != fl || tsl != sl) {
+                    printf("Block in wrong free list!\n");
+                    printf("block_ptr = %p, size = %zu, fl = %d, sl = %d\n", temp, GET_SIZE(temp), fl, sl);
+                    exit(0);
+                }
+                printBlock(temp);
+                if (S_SUCC_BLKP(temp) != virtual_NULL && temp != (void *) S_PRED_BLKP(S_SUCC_BLKP(temp))) {
+                    printf("PRED and SUCC inconsistency!\n");
+                    printf("block_ptr = %p, pred_of_succ = %p\n", temp, (void *) S_PRED_BLKP(S_SUCC_BLKP(temp)));
+                    exit(0);
+                }
+                temp = (void *) S_SUCC_BLKP(temp);
+            }
+        }
+    }
+}
+#else
+/*遍历索引的每个叶子，如果键没有严格递增或者不在叶子的下界之上则报错
+ * 如果键对应的块不是空闲块或者大小不对应则报错
+ * 再遍历当前arena的每段chunk，如果空闲块的键不在索引中则报错*/
+static inline void bt_checker(void) {
+    unsigned long prev = 0;
+    unsigned long nfree = 0;
+    for (size_t i = 0; i < cur_arena->bt_nleaves; i++) {
+        bt_leaf_t *l = cur_arena->bt_leaves[i];
+        if (l->n == 0 || l->n > BT_LEAF_KEYS || l->keys[0] < cur_arena->bt_bounds[i]) {
+            printf("Leaf and its bound inconsistency!\n");
+            printf("leaf = %zu, n = %lu, bound = %lx\n", i, l->n, cur_arena->bt_bounds[i]);
+            exit(0);
+        }
+        for (unsigned long j = 0; j < l->n; j++) {
+            void *bp = (void *) BT_KEY_BLKP(l->keys[j]);
+            if ((i | j) != 0 && l->keys[j] <= prev) {
+                printf("Keys out of order!\n");
+                printf("leaf = %zu, key = %lx, previous = %lx\n", i, l->keys[j], prev);
+                exit(0);
+            }
+            if (GET_ALLOC(bp) || GET_SIZE(bp) != BT_KEY_SIZE(l->keys[j])) {
+                printf("Key and block inconsistency!\n");
+                printf("block_ptr = %p, header = %lx, key = %lx\n", bp, (unsigned long) GET(HDRP(bp)), l->keys[j]);
+                exit(0);
+            }
+            printBlock(bp);
+            prev = l->keys[j];
+        }
+    }
+    for (char *bp = compact_run(0); bp != NULL; bp = NEXT_BLKP(bp)) {
+        if (GET_SIZE(bp) == 0) {
+            bp = compact_run((((unsigned long) bp - 1 - virtual_NULL) >> ARENA_UNIT_SHIFT) + 1);
+            if (bp == NULL)
+                break;
+        }
+        if (GET_ALLOC(bp))
+            continue;
+        unsigned long key = BT_KEY(GET_SIZE(bp), bp);
+        bt_leaf_t *l = cur_arena->bt_nleaves ? cur_arena->bt_leaves[bt_leaf_of(key)] : NULL;
+        int j = l ? bt_lower(l, key) : 0;
+        if (l == NULL || j == (int) l->n || l->keys[j] != key) {
+            printf("Free block not in the index!\n");
+            printf("block_ptr = %p, header = %lx\n", bp, (unsigned long) GET(HDRP(bp)));
+            exit(0);
+        }
+        nfree++;
+    }
+    if (nfree != cur_arena->free_blocks) {
+        printf("Free block count inconsistency!\n");
+        printf("blocks in heap = %lu, free_blocks = %lu\n", nfree, cur_arena->free_blocks);
+        exit(0);
+    }
+}
+#endif
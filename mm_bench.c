@@ -0,0 +1,242 @@
+/*
+ * mm_bench - 比较几种空闲块引擎的延迟与空间利用率
+ *
+ * 随机生成malloc/free/realloc序列，逐次计时，输出每种操作的p50/p99/p99.9/max延迟(ns)，
+ * 以及峰值有效负载与最终堆大小之比(利用率)。空闲块引擎在编译时选择，分别编译再比较：
+ *     gcc -O2 -DDRIVER -o mm_bench_bst mm.c memlib.c mm_bench.c
+ *     gcc -O2 -DDRIVER -DMM_TLSF -o mm_bench_tlsf mm.c memlib.c mm_bench.c
+ *     gcc -O2 -DDRIVER -DMM_BTREE -o mm_bench_btree mm.c memlib.c mm_bench.c
+ *     ./mm_bench_bst -n 1000000 && ./mm_bench_tlsf -n 1000000 && ./mm_bench_btree -n 1000000
+ * 加-DMM_RESERVE则堆由保留的地址空间提供，不经过memlib。
+ *
+ * 同时输出吞吐量，以及整个请求序列期间的dTLB缺失和缺页次数(perf_event_open，只计用户态；
+ * 没有硬件计数器时，比如在虚拟机中，dTLB一项为n/a)。比较透明大页的效果时用较多的活跃块撑大堆：
+ *     gcc -O2 -DDRIVER -o mm_bench_4k mm.c memlib.c mm_bench.c
+ *     gcc -O2 -DDRIVER -DMM_HUGEPAGE -o mm_bench_thp mm.c memlib.c mm_bench.c
+ *     ./mm_bench_4k -l 200000 -n 5000000 && ./mm_bench_thp -l 200000 -n 5000000
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+#if defined(MM_TLSF)
+#define ENGINE "tlsf"
+#elif defined(MM_BTREE)
+#define ENGINE "btree"
+#else
+#define ENGINE "bst"
+#endif
+
+#ifdef MM_HUGEPAGE
+#define PAGES "-thp"
+#else
+#define PAGES ""
+#endif
+
+#define OP_MALLOC  0
+#define OP_FREE    1
+#define OP_REALLOC 2
+#define NOPS       3
+
+static const char *op_names[NOPS] = {"malloc", "free", "realloc"};
+
+#define DTLB_MISS(op) (PERF_COUNT_HW_CACHE_DTLB | (op) << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+/* 性能计数器，打不开时fd为-1 */
+static struct {
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+    int fd;
+} perf_counters[] = {
+    {"dTLB-load-misses", PERF_TYPE_HW_CACHE, DTLB_MISS(PERF_COUNT_HW_CACHE_OP_READ), -1},
+    {"dTLB-store-misses", PERF_TYPE_HW_CACHE, DTLB_MISS(PERF_COUNT_HW_CACHE_OP_WRITE), -1},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1},
+};
+#define NCOUNTERS (sizeof(perf_counters) / sizeof(perf_counters[0]))
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/* xorshift64，保证两种引擎得到完全相同的请求序列 */
+static unsigned long long rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* 大小按对数均匀分布在[1, max_size]，小块居多，偶尔出现大块 */
+static size_t random_size(size_t max_size) {
+    int bits = 0;
+    while ((1UL << bits) < max_size)
+        bits++;
+    size_t size = 1 + rng() % (1UL << (rng() % (bits + 1)));
+    return size > max_size ? max_size : size;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/* 排序后输出百分位数 */
+static void report(const char *name, long long *lat, long n) {
+    if (n == 0)
+        return;
+    qsort(lat, n, sizeof(long long), cmp_ll);
+    printf("%-10s %-8s %10ld %8lld %8lld %8lld %8lld\n", ENGINE PAGES, name, n,
+           lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1]);
+}
+
+static void perf_open(void) {
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_counters[i].type;
+        attr.config = perf_counters[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf_counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static void perf_enable(int on) {
+    for (size_t i = 0; i < NCOUNTERS; i++)
+        if (perf_counters[i].fd >= 0)
+            ioctl(perf_counters[i].fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+/* 当前映射中由透明大页提供的字节数(kB) */
+static long anon_huge_kb(void) {
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    long kb = -1;
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL)
+        if (sscanf(line, "AnonHugePages: %ld", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-n ops] [-l live] [-m max_size] [-s seed]\n", prog);
+    printf("   -n   number of operations (default 1000000)\n");
+    printf("   -l   maximum number of live blocks (default 10000)\n");
+    printf("   -m   maximum request size in bytes (default 65536)\n");
+    printf("   -s   random seed\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    long nops = 1000000, nlive = 10000;
+    size_t max_size = 65536;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:l:m:s:h")) != EOF) {
+        switch (c) {
+        case 'n': nops = atol(optarg); break;
+        case 'l': nlive = atol(optarg); break;
+        case 'm': max_size = atol(optarg); break;
+        case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    char **ptrs = calloc(nlive, sizeof(char *));
+    size_t *sizes = calloc(nlive, sizeof(size_t));
+    long long *lat[NOPS];
+    long count[NOPS] = {0};
+    for (int i = 0; i < NOPS; i++)
+        lat[i] = malloc(nops * sizeof(long long));
+    if (!ptrs || !sizes || !lat[0] || !lat[1] || !lat[2]) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    mem_init();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+
+    perf_open();
+    perf_enable(1);
+    long long loop_start = now_ns();
+    size_t live = 0, peak_live = 0;
+    for (long i = 0; i < nops; i++) {
+        long slot = rng() % nlive;
+        size_t size = random_size(max_size);
+        long long start;
+        int op;
+
+        if (ptrs[slot] == NULL) {
+            op = OP_MALLOC;
+            start = now_ns();
+            ptrs[slot] = mm_malloc(size);
+        } else if (rng() % 4 == 0) {
+            op = OP_REALLOC;
+            start = now_ns();
+            ptrs[slot] = mm_realloc(ptrs[slot], size);
+            live -= sizes[slot];
+        } else {
+            op = OP_FREE;
+            start = now_ns();
+            mm_free(ptrs[slot]);
+            lat[op][count[op]++] = now_ns() - start;
+            ptrs[slot] = NULL;
+            live -= sizes[slot];
+            sizes[slot] = 0;
+            continue;
+        }
+        lat[op][count[op]++] = now_ns() - start;
+        if (ptrs[slot] == NULL) {
+            fprintf(stderr, "%s(%zu) failed\n", op_names[op], size);
+            exit(1);
+        }
+        /* 写一个字节，保证块确实可用，同时模拟真实的访问 */
+        ptrs[slot][size - 1] = 1;
+        sizes[slot] = size;
+        live += size;
+        if (live > peak_live)
+            peak_live = live;
+    }
+    long long loop_ns = now_ns() - loop_start;
+    perf_enable(0);
+
+    printf("%-10s %-8s %10s %8s %8s %8s %8s\n", "engine", "op", "count", "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < NOPS; i++)
+        report(op_names[i], lat[i], count[i]);
+    /* 堆大小从mm_stats读，不论堆由memlib还是其它后端提供 */
+    size_t heap = mm_stats().heap_size;
+    printf("%-10s peak live %zu bytes, heap %zu bytes, utilization %.1f%%\n",
+           ENGINE PAGES, peak_live, heap, 100.0 * peak_live / heap);
+    printf("%-10s %ld ops in %.3f s, %.0f ops/sec, %ld kB in huge pages\n", ENGINE PAGES,
+           nops, loop_ns / 1e9, nops * 1e9 / loop_ns, anon_huge_kb());
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        long long value;
+        if (perf_counters[i].fd < 0 || read(perf_counters[i].fd, &value, sizeof(value)) != sizeof(value))
+            printf("%-10s %-18s %14s\n", ENGINE PAGES, perf_counters[i].name, "n/a");
+        else
+            printf("%-10s %-18s %14lld\n", ENGINE PAGES, perf_counters[i].name, value);
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * mm_ext.h - mm.c在malloclab的接口(mm.h)之外提供的扩展接口
+ *
+ * mm.c和各个工具都包含这个头文件，结构体和常量只在这里声明一次。
+ * MM_LATENCY、MM_PROFILE、MM_PERSIST下的函数只有mm.c以同样的宏编译时才存在。
+ */
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+
+/* mm_stats()的结果 */
+struct mm_stats {
+    size_t in_use;//usable bytes of live allocations
+    size_t free_bytes;//bytes in free blocks of the heap
+    size_t heap_size;//bytes obtained from mem_sbrk
+    size_t mapped;//bytes in direct mappings
+    size_t peak;//peak of heap_size + mapped
+    unsigned long nmalloc, nfree, nrealloc;//calls, a moving realloc also counts one malloc and one free
+    unsigned long nextend;//heap extensions
+    unsigned long free_blocks;//blocks in the free structures
+    unsigned long bst_nodes, hanger_nodes;//nodes of the BSTs and blocks hanging on them, 0 with MM_TLSF or MM_BTREE
+    size_t largest_free;//largest free block of the heap
+    double fragmentation;//1 - largest_free / free_bytes
+    unsigned long hist[64];//live allocations, indexed by floor(log2(usable size))
+};
+
+/* mm_malloc_hint的提示 */
+#define MM_HINT_SHORT 1//dies soon, e.g. per-message temporaries
+#define MM_HINT_LONG 2//lives long, placed as by malloc
+
+/* mm_heap_profile_dump的输出格式 */
+#define MM_PROF_PPROF 0
+#define MM_PROF_FOLDED 1//in-use bytes
+#define MM_PROF_FOLDED_ALLOC 2//bytes allocated since start
+
+typedef unsigned int mm_handle_t;//index into the handle table, 0 is never a valid handle
+
+/* mm_persist_open的返回值 */
+#define MM_PERSIST_NEW 0//the file was empty, a new heap was created
+#define MM_PERSIST_RESTORED 1//mapped at the address it was saved at, all pointers are valid
+#define MM_PERSIST_MOVED 2//mapped elsewhere, only offsets stored in user data are valid
+
+struct mm_arena;
+struct mm_pool;
+
+/* 统计与调节 */
+struct mm_stats mm_stats(void);
+void mm_growth_stats(unsigned long *nextend, size_t *extended, size_t *chunk);
+void mm_set_mmap_threshold(size_t threshold);
+void mm_set_trim_threshold(size_t threshold);
+void mm_set_growth(size_t min, size_t max);
+int mm_trim(size_t pad);
+void mm_tcache_flush(void);
+#ifdef MM_LATENCY
+unsigned long mm_latency_bucket(int op, int bucket);
+unsigned long mm_slowpath_count(int event);
+void mm_latency_reset(void);
+void mm_latency_dump(int fd);
+int mm_latency_signal(int signo);
+#endif
+#ifdef MM_PROFILE
+void mm_set_profile_rate(size_t rate);
+int mm_heap_profile_dump(int fd, int format);
+#endif
+
+/* 按寿命分配与批量分配 */
+void *mm_malloc_hint(size_t size, int hint);
+size_t mm_malloc_batch(const size_t sizes[], size_t n, void *out[]);
+void mm_free_batch(void *ptrs[], size_t n);
+
+/* 区域 */
+struct mm_arena *mm_arena_create(size_t chunk_size);
+void *mm_arena_alloc(struct mm_arena *ar, size_t size);
+void mm_arena_reset(struct mm_arena *ar);
+void mm_arena_destroy(struct mm_arena *ar);
+
+/* 固定大小对象的池 */
+struct mm_pool *mm_pool_create(size_t object_size, size_t align);
+void *mm_pool_alloc(struct mm_pool *pool);
+void mm_pool_free(struct mm_pool *pool, void *p);
+void mm_pool_destroy(struct mm_pool *pool);
+
+/* 可移动的对象 */
+mm_handle_t mm_halloc(size_t size);
+void *mm_hpin(mm_handle_t h);
+void mm_hunpin(mm_handle_t h);
+void mm_hfree(mm_handle_t h);
+int mm_compact(size_t budget);
+
+#ifdef MM_PERSIST
+/* 放在文件中的持久化堆 */
+int mm_persist_open(const char *path, size_t max_size);
+int mm_persist_sync(void);
+int mm_persist_close(void);
+void mm_persist_set_root(void *p);
+void *mm_persist_root(void);
+#endif
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * mm_mtbench - 多线程分配器压力测试，线程数从1扫到N，结果输出为CSV
+ *
+ * 包括几种常用的测试模式：
+ *   larson         每个线程随机释放并重新分配自己数组中的块，每轮结束把数组交给下一个线程，
+ *                  于是大部分释放都发生在分配者以外的线程
+ *   threadtest     每个线程反复分配一批块再全部释放，没有跨线程的释放
+ *   active-false   每个线程反复分配一个小对象、写很多次、释放，不同线程的对象若在同一缓存行上就会互相干扰
+ *   passive-false  与active-false相同，但第一个对象由主线程分配，线程释放后分配器可能把它交给别的线程
+ *   cache-scratch  主线程为每个线程分配一个对象，线程释放后分配同样大小的对象并反复写
+ *
+ * mm.c需要以线程安全的模式编译，-s改为测试系统的malloc：
+ *     gcc -O2 -DDRIVER -DMM_THREADS -o mm_mtbench mm.c memlib.c mm_mtbench.c -lpthread
+ *     ./mm_mtbench -t 8 > mm.csv && ./mm_mtbench -s -t 8 > libc.csv
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_THREADS 64
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 20
+#define FALSE_WRITES 1000
+
+static void *(*alloc_fn)(size_t);
+static void (*free_fn)(void *);
+
+static long iterations = 100000;//operations per thread
+static int nthreads;
+
+static pthread_barrier_t start_barrier;
+
+typedef struct {
+    int id;
+    unsigned long long rng;
+    void *arg;//object handed over by the main thread
+    void *(*fn)(void *);
+    long ops;
+    double start, end;
+} worker_t;
+
+static worker_t workers[MAX_THREADS];
+
+static unsigned long long rng(worker_t *w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *xalloc(size_t size) {
+    void *p = alloc_fn(size);
+    if (p == NULL) {
+        fprintf(stderr, "allocation of %zu bytes failed\n", size);
+        exit(1);
+    }
+    return p;
+}
+
+/* larson：每轮在自己的数组上随机替换，轮末与下一个线程交换数组 */
+static void **larson_arrays[MAX_THREADS];
+static pthread_barrier_t round_barrier;
+
+static void *larson(void *arg) {
+    worker_t *w = arg;
+    long per_round = iterations / LARSON_ROUNDS;
+    for (int r = 0; r < LARSON_ROUNDS; r++) {
+        void **slots = larson_arrays[(w->id + r) % nthreads];
+        for (long i = 0; i < per_round; i++) {
+            int k = rng(w) % LARSON_SLOTS;
+            free_fn(slots[k]);
+            slots[k] = xalloc(8 + rng(w) % 256);
+            w->ops += 2;
+        }
+        pthread_barrier_wait(&round_barrier);
+    }
+    return NULL;
+}
+
+/* threadtest：分配一批再全部释放 */
+static void *threadtest(void *arg) {
+    worker_t *w = arg;
+    void *batch[100];
+    for (long i = 0; i < iterations / 100; i++) {
+        for (int k = 0; k < 100; k++)
+            batch[k] = xalloc(8 + k % 8 * 8);
+        for (int k = 0; k < 100; k++)
+            free_fn(batch[k]);
+        w->ops += 200;
+    }
+    return NULL;
+}
+
+/* 反复写一个对象，volatile防止写被合并 */
+static void scribble(void *p, size_t size) {
+    volatile char *c = p;
+    for (int j = 0; j < FALSE_WRITES; j++)
+        for (size_t k = 0; k < size; k++)
+            c[k]++;
+}
+
+static void *active_false(void *arg) {
+    worker_t *w = arg;
+    for (long i = 0; i < iterations / 100; i++) {
+        char *p = xalloc(8);
+        scribble(p, 8);
+        free_fn(p);
+        w->ops += 2;
+    }
+    return NULL;
+}
+
+static void *passive_false(void *arg) {
+    worker_t *w = arg;
+    free_fn(w->arg);
+    w->ops++;
+    for (long i = 0; i < iterations / 100; i++) {
+        char *p = xalloc(8);
+        scribble(p, 8);
+        free_fn(p);
+        w->ops += 2;
+    }
+    return NULL;
+}
+
+static void *cache_scratch(void *arg) {
+    worker_t *w = arg;
+    free_fn(w->arg);
+    char *p = xalloc(8);
+    /* 这里的操作数是写对象的轮数 */
+    for (long i = 0; i < iterations / 100; i++) {
+        scribble(p, 8);
+        w->ops++;
+    }
+    free_fn(p);
+    return NULL;
+}
+
+typedef struct {
+    const char *name;
+    void *(*fn)(void *);
+    int handoff;//main thread allocates one object for each worker
+} test_t;
+
+static test_t tests[] = {
+    {"larson", larson, 0},
+    {"threadtest", threadtest, 0},
+    {"active-false", active_false, 0},
+    {"passive-false", passive_false, 1},
+    {"cache-scratch", cache_scratch, 1},
+};
+#define NTESTS (sizeof(tests) / sizeof(tests[0]))
+
+/* 所有线程就绪后各自计时，单核上主线程可能在工作线程结束后才被调度，不能由主线程计时 */
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    pthread_barrier_wait(&start_barrier);
+    w->start = now_sec();
+    w->fn(w);
+    w->end = now_sec();
+    return NULL;
+}
+
+/* 运行一个测试，返回从最早的线程开始到最晚的线程结束的秒数 */
+static double run(test_t *t, int n) {
+    pthread_t tid[MAX_THREADS];
+
+    nthreads = n;
+    pthread_barrier_init(&start_barrier, NULL, n + 1);
+    pthread_barrier_init(&round_barrier, NULL, n);
+    if (t->fn == larson) {
+        for (int i = 0; i < n; i++) {
+            larson_arrays[i] = xalloc(LARSON_SLOTS * sizeof(void *));
+            for (int k = 0; k < LARSON_SLOTS; k++)
+                larson_arrays[i][k] = xalloc(8 + k % 256);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        workers[i].id = i;
+        workers[i].rng = 88172645463325252ULL + i * 7919;
+        workers[i].ops = 0;
+        /* 连续分配的对象很可能在同一缓存行上 */
+        workers[i].arg = t->handoff ? xalloc(8) : NULL;
+        workers[i].fn = t->fn;
+        pthread_create(&tid[i], NULL, worker_main, &workers[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    double start = 1e300, end = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_join(tid[i], NULL);
+        if (workers[i].start < start) start = workers[i].start;
+        if (workers[i].end > end) end = workers[i].end;
+    }
+    double elapsed = end - start;
+
+    if (t->fn == larson) {
+        for (int i = 0; i < n; i++) {
+            for (int k = 0; k < LARSON_SLOTS; k++)
+                free_fn(larson_arrays[i][k]);
+            free_fn(larson_arrays[i]);
+        }
+    }
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&round_barrier);
+    return elapsed;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-s] [-t max_threads] [-n iterations] [-b test]\n", prog);
+    printf("   -s   use the system malloc instead of mm.c\n");
+    printf("   -t   sweep thread counts from 1 to this (default number of CPUs)\n");
+    printf("   -n   operations per thread (default 100000)\n");
+    printf("   -b   run only this test\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int system_malloc = 0, max_threads = sysconf(_SC_NPROCESSORS_ONLN), c;
+    const char *only = NULL;
+
+    while ((c = getopt(argc, argv, "st:n:b:h")) != EOF) {
+        switch (c) {
+        case 's': system_malloc = 1; break;
+        case 't': max_threads = atoi(optarg); break;
+        case 'n': iterations = atol(optarg); break;
+        case 'b': only = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS)
+        max_threads = MAX_THREADS;
+
+    alloc_fn = system_malloc ? malloc : mm_malloc;
+    free_fn = system_malloc ? free : mm_free;
+    if (!system_malloc) {
+        mem_init();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mm_init failed\n");
+            exit(1);
+        }
+    }
+
+    printf("test,allocator,threads,seconds,ops_per_sec\n");
+    for (size_t t = 0; t < NTESTS; t++) {
+        if (only != NULL && strcmp(only, tests[t].name) != 0)
+            continue;
+        for (int n = 1; n <= max_threads; n++) {
+            double sec = run(&tests[t], n);
+            long ops = 0;
+            for (int i = 0; i < n; i++)
+                ops += workers[i].ops;
+            printf("%s,%s,%d,%.6f,%.0f\n", tests[t].name, system_malloc ? "system" : "mm",
+                   n, sec, sec > 0 ? ops / sec : 0.0);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * mm_replay - 在mm.c和glibc malloc上重放分配轨迹
+ *
+ * 轨迹有两种格式：
+ * 1.文本，每行一个操作："a id size"、"r id size"、"f id"，与malloclab的traces相同，
+ *   开头可以有traces中的四个数字(堆大小建议、id个数、操作个数、权重)，会被跳过
+ * 2.二进制，开头是8字节的"MMTRACE1"，之后是trace_rec_t的数组，mm_trace.so抓取的就是这种格式
+ *
+ * 输出每秒操作数、峰值堆大小与峰值有效负载之比(利用率)、有效负载最多时的碎片率(1 - 最大空闲块 / 空闲字节)、
+ * 每种操作的p50/p99/p99.9/max延迟(ns)：
+ *     gcc -O2 -DDRIVER -o mm_replay mm.c memlib.c mm_replay.c
+ *     ./mm_replay traces/amptjp-bal.rep          # mm.c
+ *     ./mm_replay -g traces/amptjp-bal.rep       # glibc malloc
+ * -H n用轨迹本身作为寿命的预言：n个操作之内就会被释放的块用mm_malloc_hint(MM_HINT_SHORT)分配，
+ * 其余用MM_HINT_LONG，比较加与不加-H时的利用率即可看出按寿命分开放置的效果：
+ *     ./mm_replay -H 1000 traces/amptjp-bal.rep
+ * 抓取正在运行的程序的轨迹：
+ *     gcc -O2 -shared -fPIC -o mm_trace.so mm_trace.c -lpthread
+ *     MM_TRACE_FILE=app.trace LD_PRELOAD=./mm_trace.so ./app
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+#define OP_MALLOC  0
+#define OP_FREE    1
+#define OP_REALLOC 2
+#define NOPS       3
+
+#define TRACE_MAGIC "MMTRACE1"
+
+/* 二进制轨迹的一条记录，与mm_trace.c中的布局相同 */
+typedef struct {
+    uint8_t op;//'a', 'r' or 'f'
+    uint8_t pad[3];
+    uint32_t id;
+    uint64_t size;
+} trace_rec_t;
+
+#define MAX(x, y) ((x) > (y)? (x) : (y))
+
+static const char *op_names[NOPS] = {"malloc", "free", "realloc"};
+
+static trace_rec_t *recs;
+static long nrecs, cap_recs;
+static uint32_t max_id;
+
+static void add_rec(int op, uint32_t id, uint64_t size) {
+    if (nrecs == cap_recs) {
+        cap_recs = cap_recs ? cap_recs * 2 : 4096;
+        if ((recs = realloc(recs, cap_recs * sizeof(trace_rec_t))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    recs[nrecs].op = op;
+    recs[nrecs].id = id;
+    recs[nrecs].size = size;
+    nrecs++;
+    if (id > max_id)
+        max_id = id;
+}
+
+/* 整个轨迹读入内存，重放时不再有I/O */
+static void read_trace(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char magic[8];
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    if (fread(magic, 1, 8, fp) == 8 && memcmp(magic, TRACE_MAGIC, 8) == 0) {
+        trace_rec_t rec;
+        while (fread(&rec, sizeof(rec), 1, fp) == 1)
+            add_rec(rec.op, rec.id, rec.size);
+        fclose(fp);
+        return;
+    }
+
+    rewind(fp);
+    char line[256], op;
+    unsigned long id, size;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, " %c %lu %lu", &op, &id, &size) < 2)
+            continue;
+        if (op == 'a' || op == 'r')
+            add_rec(op, id, size);
+        else if (op == 'f')
+            add_rec(op, id, 0);
+        /* 其它行(malloclab的头部、空行)忽略 */
+    }
+    fclose(fp);
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *alloc, const char *name, long long *lat, long n) {
+    if (n == 0)
+        return;
+    qsort(lat, n, sizeof(long long), cmp_ll);
+    printf("%-8s %-8s %10ld %8lld %8lld %8lld %8lld\n", alloc, name, n,
+           lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1]);
+}
+
+/* glibc的堆大小：主arena加上mmap的块 */
+static size_t glibc_heap(void) {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-g] [-n repeat] [-H ops] tracefile\n", prog);
+    printf("   -g   replay against glibc malloc instead of mm.c\n");
+    printf("   -n   replay the trace this many times (default 1)\n");
+    printf("   -H   hint blocks freed within this many operations as short-lived\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int glibc = 0, repeat = 1, c;
+    long hint_ops = 0;
+
+    while ((c = getopt(argc, argv, "gn:H:h")) != EOF) {
+        switch (c) {
+        case 'g': glibc = 1; break;
+        case 'n': repeat = atoi(optarg); break;
+        case 'H': hint_ops = atol(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    read_trace(argv[optind]);
+
+    void *(*alloc_fn)(size_t) = glibc ? malloc : mm_malloc;
+    void (*free_fn)(void *) = glibc ? free : mm_free;
+    void *(*realloc_fn)(void *, size_t) = glibc ? realloc : mm_realloc;
+    const char *name = glibc ? "glibc" : hint_ops ? "mm-hint" : "mm";
+
+    char **ptrs = calloc(max_id + 1, sizeof(char *));
+    size_t *sizes = calloc(max_id + 1, sizeof(size_t));
+    long long *lat[NOPS];
+    long count[NOPS] = {0};
+    for (int i = 0; i < NOPS; i++)
+        lat[i] = malloc(nrecs * repeat * sizeof(long long) + 1);
+    if (!ptrs || !sizes || !lat[0] || !lat[1] || !lat[2]) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    /* 从后向前扫描，得到每次分配之后同一个id第一次被释放的位置 */
+    long *death = NULL;
+    if (hint_ops && !glibc) {
+        long *next_free = malloc((max_id + 1) * sizeof(long));
+        death = malloc(nrecs * sizeof(long) + 1);
+        if (!next_free || !death) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (uint32_t id = 0; id <= max_id; id++)
+            next_free[id] = nrecs;
+        for (long i = nrecs - 1; i >= 0; i--) {
+            if (recs[i].op == 'f')
+                next_free[recs[i].id] = i;
+            death[i] = next_free[recs[i].id];
+        }
+        free(next_free);
+    }
+
+    if (!glibc) {
+        mem_init();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mm_init failed\n");
+            exit(1);
+        }
+    }
+
+    size_t live = 0, peak_live = 0, peak_heap = glibc ? glibc_heap() : 0;
+    double peak_frag = 0;
+    long long total = 0;
+    for (int r = 0; r < repeat; r++) {
+        for (long i = 0; i < nrecs; i++) {
+            trace_rec_t *rec = &recs[i];
+            long long start, t;
+            int op;
+
+            if (rec->op == 'a') {
+                op = OP_MALLOC;
+                int hint = death && death[i] - i < hint_ops ? MM_HINT_SHORT : MM_HINT_LONG;
+                start = now_ns();
+                ptrs[rec->id] = death ? mm_malloc_hint(rec->size, hint) : alloc_fn(rec->size);
+                t = now_ns() - start;
+            } else if (rec->op == 'r') {
+                op = OP_REALLOC;
+                start = now_ns();
+                ptrs[rec->id] = realloc_fn(ptrs[rec->id], rec->size);
+                t = now_ns() - start;
+            } else {
+                op = OP_FREE;
+                start = now_ns();
+                free_fn(ptrs[rec->id]);
+                t = now_ns() - start;
+                ptrs[rec->id] = NULL;
+                live -= sizes[rec->id];
+                sizes[rec->id] = 0;
+            }
+            lat[op][count[op]++] = t;
+            total += t;
+            if (op != OP_FREE) {
+                if (ptrs[rec->id] == NULL && rec->size != 0) {
+                    fprintf(stderr, "%s(%lu) failed\n", op_names[op], (unsigned long) rec->size);
+                    exit(1);
+                }
+                live += rec->size - sizes[rec->id];
+                sizes[rec->id] = rec->size;
+                /* 有效负载最多时的碎片率，mm_stats只加总计数器，在计时之外调用 */
+                if (live > peak_live) {
+                    peak_live = live;
+                    if (!glibc)
+                        peak_frag = mm_stats().fragmentation;
+                }
+            }
+            /* mallinfo2要遍历glibc的bin，在计时之外调用 */
+            if (glibc)
+                peak_heap = MAX(peak_heap, glibc_heap());
+        }
+        /* 轨迹结束时未释放的块在下一轮重放前释放，不计时 */
+        for (uint32_t id = 0; id <= max_id; id++) {
+            if (ptrs[id] != NULL) {
+                free_fn(ptrs[id]);
+                ptrs[id] = NULL;
+                live -= sizes[id];
+                sizes[id] = 0;
+            }
+        }
+    }
+    if (glibc)
+        peak_heap = MAX(peak_heap, glibc_heap());
+    else
+        peak_heap = mm_stats().peak;
+
+    printf("%-8s %-8s %10s %8s %8s %8s %8s\n", "alloc", "op", "count", "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < NOPS; i++)
+        report(name, op_names[i], lat[i], count[i]);
+    printf("%-8s %ld ops, %.0f ops/sec\n", name, count[0] + count[1] + count[2],
+           total ? (count[0] + count[1] + count[2]) * 1e9 / total : 0.0);
+    printf("%-8s peak live %zu bytes, peak heap %zu bytes, utilization %.1f%%\n",
+           name, peak_live, peak_heap, peak_heap ? 100.0 * peak_live / peak_heap : 0.0);
+    if (!glibc)
+        printf("%-8s fragmentation %.3f at peak live\n", name, peak_frag);
+    return 0;
+}
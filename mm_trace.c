@@ -0,0 +1,307 @@
+/*
+ * mm_trace - 用LD_PRELOAD抓取正在运行的程序的分配轨迹，交给mm_replay重放
+ *
+ *     gcc -O2 -shared -fPIC -o mm_trace.so mm_trace.c -lpthread
+ *     MM_TRACE_FILE=app.trace LD_PRELOAD=./mm_trace.so ./app
+ *     ./mm_replay app.trace
+ *
+ * malloc/calloc/realloc/free以及对齐分配都转给glibc的__libc_*函数，同时把操作追加到轨迹文件中。
+ * 指针到id的映射是开放寻址的哈希表，id在块释放后回收，所以重放时需要的数组不会比峰值块数大太多。
+ * 表和缓冲区都直接用mmap申请，避免自己的分配再次进入malloc。多线程的程序用一把锁串行化记录，
+ * 轨迹中的顺序就是加锁的顺序。
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC "MMTRACE1"
+#define BUF_RECS 4096
+
+/* 二进制轨迹的一条记录，与mm_replay.c中的布局相同 */
+typedef struct {
+    uint8_t op;//'a', 'r' or 'f'
+    uint8_t pad[3];
+    uint32_t id;
+    uint64_t size;
+} trace_rec_t;
+
+/* 哈希表的一项，ptr为0表示空，为1表示已删除 */
+typedef struct {
+    uintptr_t ptr;
+    uint32_t id;
+} slot_t;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static int trace_failed = 0;
+static trace_rec_t buf[BUF_RECS];
+static int nbuf = 0;
+
+static slot_t *table = 0;
+static size_t table_cap = 0, table_used = 0;//used counts deleted slots too
+static uint32_t *free_ids = 0;//stack of recycled ids
+static size_t nfree_ids = 0, free_ids_cap = 0;
+static uint32_t next_id = 0;
+
+static __thread int in_trace = 0;//calls made while recording are not recorded
+
+static void *raw_alloc(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void flush_buf(void) {
+    char *p = (char *) buf;
+    size_t left = nbuf * sizeof(trace_rec_t);
+    while (left > 0) {
+        ssize_t n = write(trace_fd, p, left);
+        if (n <= 0)
+            break;
+        p += n;
+        left -= n;
+    }
+    nbuf = 0;
+}
+
+static void trace_close(void) {
+    in_trace = 1;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        flush_buf();
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    in_trace = 0;
+}
+
+/* 第一次记录时打开轨迹文件，调用者需持有trace_lock */
+static int trace_open(void) {
+    if (trace_fd >= 0)
+        return 1;
+    if (trace_failed)
+        return 0;
+    const char *path = getenv("MM_TRACE_FILE");
+    if (path == NULL)
+        path = "mm.trace";
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0 || write(trace_fd, TRACE_MAGIC, 8) != 8) {
+        trace_failed = 1;
+        return 0;
+    }
+    atexit(trace_close);
+    return 1;
+}
+
+static size_t hash_ptr(uintptr_t p) {
+    p ^= p >> 33;
+    p *= 0xff51afd7ed558ccdULL;
+    p ^= p >> 33;
+    return p;
+}
+
+/* 装填率超过一半时加倍重建，顺便清掉已删除的项 */
+static int table_grow(void) {
+    size_t cap = table_cap ? table_cap * 2 : 1 << 16;
+    slot_t *t = raw_alloc(cap * sizeof(slot_t));
+    if (t == NULL)
+        return 0;
+    table_used = 0;
+    for (size_t i = 0; i < table_cap; i++) {
+        if (table[i].ptr > 1) {
+            size_t j = hash_ptr(table[i].ptr) & (cap - 1);
+            while (t[j].ptr != 0)
+                j = (j + 1) & (cap - 1);
+            t[j] = table[i];
+            table_used++;
+        }
+    }
+    if (table != 0)
+        munmap(table, table_cap * sizeof(slot_t));
+    table = t;
+    table_cap = cap;
+    return 1;
+}
+
+static uint32_t new_id(void) {
+    return nfree_ids != 0 ? free_ids[--nfree_ids] : next_id++;
+}
+
+static void put_id(uintptr_t p, uint32_t id) {
+    if ((table_used + 1) * 2 > table_cap && !table_grow())
+        return;
+    size_t j = hash_ptr(p) & (table_cap - 1);
+    while (table[j].ptr > 1)
+        j = (j + 1) & (table_cap - 1);
+    if (table[j].ptr == 0)
+        table_used++;
+    table[j].ptr = p;
+    table[j].id = id;
+}
+
+/* 删除p的映射并返回它的id，p不是记录过的指针(比如在预加载之前分配的)时返回-1 */
+static long take_id(uintptr_t p) {
+    if (table_cap == 0)
+        return -1;
+    size_t j = hash_ptr(p) & (table_cap - 1);
+    while (table[j].ptr != 0) {
+        if (table[j].ptr == p) {
+            table[j].ptr = 1;
+            return table[j].id;
+        }
+        j = (j + 1) & (table_cap - 1);
+    }
+    return -1;
+}
+
+static void recycle_id(uint32_t id) {
+    if (nfree_ids == free_ids_cap) {
+        size_t cap = free_ids_cap ? free_ids_cap * 2 : 1 << 14;
+        uint32_t *ids = raw_alloc(cap * sizeof(uint32_t));
+        if (ids == NULL)
+            return;
+        if (free_ids != 0) {
+            memcpy(ids, free_ids, nfree_ids * sizeof(uint32_t));
+            munmap(free_ids, free_ids_cap * sizeof(uint32_t));
+        }
+        free_ids = ids;
+        free_ids_cap = cap;
+    }
+    free_ids[nfree_ids++] = id;
+}
+
+static void emit(int op, uint32_t id, size_t size) {
+    buf[nbuf].op = op;
+    buf[nbuf].id = id;
+    buf[nbuf].size = size;
+    if (++nbuf == BUF_RECS)
+        flush_buf();
+}
+
+/*
+ * 记录一次操作：old为被释放或被realloc的指针，ptr为新得到的指针，调用者需已进入trace
+ * realloc失败时原来的块不变，不记录
+ */
+static void record(int op, void *old, void *ptr, size_t size) {
+    if (!trace_open())
+        return;
+    if (op == 'a' && ptr != NULL) {
+        uint32_t id = new_id();
+        put_id((uintptr_t) ptr, id);
+        emit('a', id, size);
+    } else if (op == 'f') {
+        long id = take_id((uintptr_t) old);
+        if (id >= 0) {
+            emit('f', id, 0);
+            recycle_id(id);
+        }
+    } else if (op == 'r' && (ptr != NULL || size == 0)) {
+        long id = take_id((uintptr_t) old);
+        if (id < 0) {
+            /* 不认识的块当作新的分配 */
+            if (ptr != NULL) {
+                id = new_id();
+                emit('a', id, size);
+            }
+        } else {
+            emit('r', id, size);
+        }
+        if (ptr != NULL)
+            put_id((uintptr_t) ptr, id);
+        else if (id >= 0)
+            recycle_id(id);
+    }
+}
+
+/* 记录期间glibc内部的分配不再记录；返回0表示当前调用发生在记录期间 */
+static int trace_enter(void) {
+    if (in_trace)
+        return 0;
+    in_trace = 1;
+    pthread_mutex_lock(&trace_lock);
+    return 1;
+}
+
+static void trace_leave(void) {
+    pthread_mutex_unlock(&trace_lock);
+    in_trace = 0;
+}
+
+/*
+ * 分配在glibc返回之后记录，释放在还给glibc之前记录，这样同一个地址在轨迹中总是先释放再分配
+ * realloc会同时释放和分配，整个调用都在锁内
+ */
+void *malloc(size_t size) {
+    void *p = __libc_malloc(size);
+    if (trace_enter()) {
+        record('a', NULL, p, size);
+        trace_leave();
+    }
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *p = __libc_calloc(nmemb, size);
+    if (trace_enter()) {
+        record('a', NULL, p, nmemb * size);
+        trace_leave();
+    }
+    return p;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return malloc(size);
+    if (!trace_enter())
+        return __libc_realloc(ptr, size);
+    void *p = __libc_realloc(ptr, size);
+    record('r', ptr, p, size);
+    trace_leave();
+    return p;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL)
+        return;
+    if (trace_enter()) {
+        record('f', ptr, NULL, 0);
+        trace_leave();
+    }
+    __libc_free(ptr);
+}
+
+/* 对齐分配在轨迹中只是普通的分配 */
+void *memalign(size_t alignment, size_t size) {
+    void *p = __libc_memalign(alignment, size);
+    if (trace_enter()) {
+        record('a', NULL, p, size);
+        trace_leave();
+    }
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *p = memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}